@@ -0,0 +1,262 @@
+#!/usr/bin/env python
+#
+# benchmark for pyid3lib.
+#
+# builds a reproducible corpus of synthetic MP3 files (the tags are
+# written directly, byte by byte, so the corpus doesn't depend on the
+# module being measured), times the common operations over it, and
+# prints the results as JSON on stdout.
+#
+#   python bench.py [--count N] [--seed S] [--max-apic BYTES] [--dir DIR]
+#
+# run it against an installed pyid3lib, or from the build directory
+# with PYTHONPATH pointing at the built module.
+
+import os
+import sys
+import time
+import json
+import random
+import shutil
+import struct
+import resource
+import tempfile
+import optparse
+
+import pyid3lib
+
+
+#
+# corpus generation
+#
+
+TEXT_FRAMES = [ 'TIT2', 'TPE1', 'TALB', 'TCON', 'TCOM', 'TEXT', 'TPUB', 'TENC' ]
+
+FRAME_COUNTS = [ 2, 8, 32 ]
+TEXT_SIZES = [ 8, 128, 2048 ]
+APIC_SIZES = [ 0, 0, 16 << 10, 256 << 10, 2 << 20, 10 << 20 ]
+VERSIONS = [ 'v2', 'v2', 'v1', 'v1+v2' ]
+PADDINGS = [ 0, 1024, 8192 ]
+UNSYNC = [ False, False, True ]
+
+# one MPEG-1 layer III frame, 128kbps at 44.1kHz, all silence
+MPEG_FRAME = '\xff\xfb\x90\x64' + '\x00' * 413
+MPEG_FRAMES = 40
+
+def syncsafe( n ):
+    return chr( (n >> 21) & 0x7f ) + chr( (n >> 14) & 0x7f ) + \
+           chr( (n >> 7) & 0x7f ) + chr( n & 0x7f )
+
+def frame( fid, data ):
+    return fid + struct.pack( '>IH', len( data ), 0 ) + data
+
+def unsynchronise( data ):
+    out = []
+    for i in xrange( len( data ) ):
+        out.append( data[i] )
+        if data[i] == '\xff' and (i + 1 == len( data ) or
+                                  data[i+1] == '\x00' or data[i+1] >= '\xe0'):
+            out.append( '\x00' )
+    return ''.join( out )
+
+def text( rng, size ):
+    return ''.join( [ chr( rng.randint( 0x20, 0x7e ) ) for i in xrange( size ) ] )
+
+def id3v2( rng, nframes, textsize, apicsize, padding, unsync ):
+    frames = []
+    for i in xrange( nframes ):
+        if i < len( TEXT_FRAMES ):
+            frames.append( frame( TEXT_FRAMES[i], '\x00' + text( rng, textsize ) ) )
+        else:
+            frames.append( frame( 'TXXX', '\x00desc%d\x00' % i + text( rng, textsize ) ) )
+
+    if apicsize:
+        # random bytes, so the picture is full of 0xff's when the tag
+        # is unsynchronised.
+        picture = ( '%0*x' % ( 2 * apicsize, rng.getrandbits( 8 * apicsize ) ) ).decode( 'hex' )
+        frames.append( frame( 'APIC', '\x00image/jpeg\x00\x03\x00' + picture ) )
+
+    body = ''.join( frames ) + '\x00' * padding
+    flags = 0
+    if unsync:
+        body = unsynchronise( body )
+        flags |= 0x80
+
+    return 'ID3\x03\x00' + chr( flags ) + syncsafe( len( body ) ) + body
+
+def id3v1( rng ):
+    return 'TAG' + text( rng, 30 ) + text( rng, 30 ) + text( rng, 30 ) + \
+           '2002' + text( rng, 28 ) + '\x00\x07' + '\x0c'
+
+def make_corpus( dir, count, seed, max_apic ):
+    rng = random.Random( seed )
+    apic_sizes = [ x for x in APIC_SIZES if x <= max_apic ]
+    files = []
+
+    for n in xrange( count ):
+        versions = rng.choice( VERSIONS )
+        info = { 'versions' : versions,
+                 'frames' : rng.choice( FRAME_COUNTS ),
+                 'text' : rng.choice( TEXT_SIZES ),
+                 'apic' : rng.choice( apic_sizes ),
+                 'padding' : rng.choice( PADDINGS ),
+                 'unsync' : rng.choice( UNSYNC ) }
+
+        head = tail = ''
+        if 'v2' in versions:
+            head = id3v2( rng, info['frames'], info['text'], info['apic'],
+                          info['padding'], info['unsync'] )
+        if 'v1' in versions:
+            tail = id3v1( rng )
+
+        info['path'] = os.path.join( dir, 'track%05d.mp3' % n )
+        info['tagbytes'] = len( head ) + len( tail )
+        f = open( info['path'], 'wb' )
+        f.write( head + MPEG_FRAME * MPEG_FRAMES + tail )
+        f.close()
+        files.append( info )
+
+    return files
+
+
+#
+# timing
+#
+
+def peak_rss():
+    # ru_maxrss is in kilobytes on Linux
+    return resource.getrusage( resource.RUSAGE_SELF ).ru_maxrss * 1024
+
+def measure( name, ops, nbytes, func ):
+    start = time.time()
+    func()
+    elapsed = time.time() - start
+
+    return { 'name' : name,
+             'ops' : ops,
+             'seconds' : elapsed,
+             'ops_per_sec' : ops / elapsed if elapsed else None,
+             'bytes' : nbytes,
+             'bytes_per_sec' : nbytes / elapsed if elapsed else None,
+             'peak_rss' : peak_rss() }
+
+def run( files, repeat ):
+    paths = [ f['path'] for f in files ]
+    tagbytes = sum( [ f['tagbytes'] for f in files ] )
+    results = []
+
+    def open_all():
+        for i in xrange( repeat ):
+            for p in paths:
+                pyid3lib.tag( p )
+    results.append( measure( 'open', repeat * len( paths ), repeat * tagbytes, open_all ) )
+
+    tags = [ pyid3lib.tag( p ) for p in paths ]
+
+    def attributes():
+        for i in xrange( repeat ):
+            for t in tags:
+                for name in ( 'title', 'artist', 'album' ):
+                    try:
+                        getattr( t, name )
+                    except AttributeError:
+                        pass
+    results.append( measure( 'attributes', repeat * len( tags ) * 3, 0, attributes ) )
+
+    nframes = sum( [ len( t ) for t in tags ] )
+
+    def iterate():
+        for i in xrange( repeat ):
+            for t in tags:
+                for d in t:
+                    pass
+    results.append( measure( 'iterate', repeat * nframes, repeat * tagbytes, iterate ) )
+
+    frames = [ list( t ) for t in tags ]
+
+    def slices():
+        for i in xrange( repeat ):
+            for t, f in zip( tags, frames ):
+                t[:] = f
+    results.append( measure( 'slice_assign', repeat * nframes, repeat * tagbytes, slices ) )
+
+    tags[:] = []
+    frames[:] = []
+
+    # the first pass adds a frame bigger than any of the corpus's
+    # padding, so every tag has to grow and id3lib rewrites the file;
+    # after that the tags have id3lib's own padding, and a small
+    # change fits in place.  the stats counters say which actually
+    # happened.
+
+    filler = { 'frameid' : 'TXXX', 'description' : 'bench', 'text' : 'x' * 16384 }
+
+    def update_rewrite():
+        for p in paths:
+            t = pyid3lib.tag( p )
+            t.append( filler )
+            t.update()
+
+    def update_in_place():
+        for p in paths:
+            t = pyid3lib.tag( p )
+            t.title = 'bench'
+            t.update()
+
+    for name, func in ( ( 'update_rewrite', update_rewrite ),
+                        ( 'update_in_place', update_in_place ) ):
+        pyid3lib.reset_stats()
+        result = measure( name, len( paths ), 0, func )
+        stats = pyid3lib.stats()
+        result['bytes'] = stats['bytes_written']
+        if result['seconds']:
+            result['bytes_per_sec'] = stats['bytes_written'] / result['seconds']
+        result['updates_in_place'] = stats['updates_in_place']
+        result['updates_rewritten'] = stats['updates_rewritten']
+        results.append( result )
+
+    return results
+
+
+def main():
+    parser = optparse.OptionParser( usage = '%prog [options]' )
+    parser.add_option( '--count', type = 'int', default = 200,
+                       help = 'number of files in the corpus (default 200)' )
+    parser.add_option( '--seed', type = 'int', default = 1,
+                       help = 'random seed for the corpus (default 1)' )
+    parser.add_option( '--max-apic', type = 'int', default = 10 << 20,
+                       help = 'largest picture to put in a tag, in bytes (default 10MB)' )
+    parser.add_option( '--repeat', type = 'int', default = 3,
+                       help = 'passes over the corpus for the read benchmarks (default 3)' )
+    parser.add_option( '--dir',
+                       help = 'build the corpus here and keep it (default: a temporary directory)' )
+    options, args = parser.parse_args()
+
+    if options.dir:
+        dir = options.dir
+        if not os.path.isdir( dir ):
+            os.makedirs( dir )
+    else:
+        dir = tempfile.mkdtemp( prefix = 'pyid3lib-bench-' )
+
+    try:
+        files = make_corpus( dir, options.count, options.seed, options.max_apic )
+        corpus = { 'files' : len( files ),
+                   'seed' : options.seed,
+                   'bytes' : sum( [ os.path.getsize( f['path'] ) for f in files ] ),
+                   'tagbytes' : sum( [ f['tagbytes'] for f in files ] ) }
+        results = run( files, options.repeat )
+    finally:
+        if not options.dir:
+            shutil.rmtree( dir )
+
+    report = { 'python' : sys.version.split()[0],
+               'pyid3lib' : pyid3lib.version,
+               'corpus' : corpus,
+               'results' : results,
+               'peak_rss' : peak_rss() }
+    json.dump( report, sys.stdout, indent = 1, sort_keys = True )
+    sys.stdout.write( '\n' )
+
+if __name__ == '__main__':
+    main()
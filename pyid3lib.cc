@@ -4,12 +4,57 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #include <id3/globals.h>
 #include <id3/field.h>
 #include <id3/id3lib_frame.h>
 #include <id3/tag.h>
 
+// what the MPEG audio in a file looks like, from stream_info_read().
+
+enum { STREAM_NONE, STREAM_XING, STREAM_VBRI, STREAM_SCAN };
+
+typedef struct
+{
+    int source;             // where the figures came from; STREAM_NONE if no audio was found
+    int version;            // MPEG version times 10: 10, 20 or 25
+    int layer;
+    int bitrate;            // average, in kbps
+    int samplerate;
+    int mode;               // channel mode bits from the frame header
+    int vbr;
+    double duration;        // seconds
+} stream_info;
+
+// binary fields whose contents were left in the file by
+// id3_defer_payloads(): which frame and field each belongs to, and
+// where its bytes sit in the file.
+
+typedef struct
+{
+    ID3_Frame* frame;
+    ID3_Field* field;
+    unsigned long long offset;
+    size_t length;
+} deferred_payload;
+
+typedef struct
+{
+    unsigned long long filesize;    // the file's size and modification time when it was read
+    long long mtime;
+    int n;
+    deferred_payload entry[1];
+} payload_table;
+
 typedef struct
 {
     PyObject_HEAD
@@ -17,8 +62,27 @@ typedef struct
     ID3_Tag* tag;
     ID3_Frame** frames;
     int size, alloc;
+    int busy;               // nonzero while file I/O runs without the GIL
+    int dirty;              // frames changed since the file was read or written
+    unsigned long long* digests;    // per-frame digests computed at load time, or NULL
+    stream_info* stream;    // audio stream details, once they've been looked for
+    flags_t versions;       // which tag types were read, and will be written
+    flags_t ondisk;         // which of those the file held when last read or written
+    char* filename;         // the file, while the ID3_Tag isn't linked to it yet
+    unsigned long maxbinary;    // binary payloads bigger than this stay in the file
+    payload_table* deferred;    // the payloads that did, or NULL
 } ID3Object;
 
+// how tag(), reopen() and scan() were asked to read a file.
+
+typedef struct
+{
+    int nocache;            // drop the file's tag pages from the cache after loading
+    flags_t versions;       // which tag types to read
+    unsigned long maxbinary;    // leave binary payloads bigger than this in the file; 0 for no limit
+    int digests;            // compute frame digests, before any payloads are left in the file
+} load_options;
+
 typedef struct
 {
     PyObject_HEAD
@@ -28,6 +92,59 @@ typedef struct
     int pos, size;
 } ID3IterObject;
 
+// how long each step of loading or saving one file took, in
+// nanoseconds.
+
+enum { PHASE_LINK, PHASE_EXTRACT, PHASE_UPDATE, NUM_PHASES };
+
+typedef struct
+{
+    unsigned long long ns[NUM_PHASES];
+} phase_times;
+
+enum { JOB_QUEUED, JOB_DONE };
+
+typedef struct
+{
+    PyObject* name;         // filename to load
+    ID3Object shell;        // tag and frames, filled in by a worker
+    phase_times times;      // and how long that took
+    int failed;             // ran out of memory while loading
+    int state;
+} scan_job;
+
+typedef struct
+{
+    PyObject_HEAD
+
+    PyObject* names;        // iterator over the filenames
+
+    // when the files are being visited in on-disk order, the caller's
+    // index for each one, in the order they will be returned.
+    long* order;
+    long returned;
+
+    // set while a next() call is in progress; it can let go of the
+    // interpreter lock, so another thread may try to step in meanwhile.
+    int busy;
+
+    // background loading; everything below is unused if nthreads == 0.
+    // queued/taken/delivered count jobs handed to the pool, picked up
+    // by a worker, and returned to the caller; jobs before "ready"
+    // are known to be finished.
+    int nthreads;
+    pthread_t* threads;
+    scan_job* jobs;
+    int njobs;
+    long queued, taken, delivered, ready;
+    int names_done, shutdown, waiting;
+    int readahead;          // issue kernel read-ahead hints for queued files
+    load_options load;      // how to read each file, and whether to compute digests
+    int streams;            // read the audio stream details as each file is loaded
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond, done_cond;
+} ID3ScanObject;
+
 #define MODULE_NAME      "pyid3lib"
 #define MODULE_VERSION   "0.5.1"
 
@@ -41,23 +158,86 @@ using namespace std;
 
 PyObject* ID3Error;
 
+// a tag is "busy" while one thread has released the interpreter lock
+// to read or write its file.  any other thread that touches the tag
+// in the meantime gets an exception rather than a half-built frame
+// array.
+
+#define CHECK_NOT_BUSY( obj, errval ) \
+    if ( (obj)->busy ) \
+    { \
+	PyErr_SetString( ID3Error, "tag is busy in another thread" ); \
+	return errval; \
+    }
+
+#define CHECK_NOT_BUSY_SCAN( obj, errval ) \
+    if ( (obj)->busy ) \
+    { \
+	PyErr_SetString( ID3Error, "scan iterator is busy in another thread" ); \
+	return errval; \
+    }
+
 void initi3d( void );
-static PyObject* id3_new( PyObject* self, PyObject* args );
+static PyObject* id3_new( PyObject* self, PyObject* args, PyObject* kwds );
 static void id3_dealloc( ID3Object* self );
-static PyObject* id3_getattr( ID3Object* self, char* attrname );
-static int id3_setattr( ID3Object* self, char* attrname, PyObject* val );
+static PyObject* id3_sizeof( ID3Object* self );
+static PyObject* id3_get_dirty( ID3Object* self, void* closure );
+static PyObject* id3_getattro( ID3Object* self, PyObject* name );
+static int id3_setattro( ID3Object* self, PyObject* name, PyObject* val );
 
 static PyObject* id3_update( ID3Object* self );
+static PyObject* id3_reopen( ID3Object* self, PyObject* args, PyObject* kwds );
+static ID3Object* id3_alloc( void );
+static ID3_Tag* tag_get( void );
+static void tag_put( ID3_Tag* tag );
+static ID3Object* id3_create( const char* filename, const load_options* opts );
+static int id3_load( ID3Object* self, const char* filename, const load_options* opts );
+static int id3_read_file( ID3Object* self, const char* filename, const load_options* opts,
+			   phase_times* times );
+static int parse_versions( const char* name, flags_t* versions, const char* func );
+
+#define TAG_KINDS  (ID3TT_ID3V1 | ID3TT_ID3V2)
+static void id3_link( ID3Object* self );
+static const char* id3_filename( ID3Object* self );
+
+static const deferred_payload* payload_find( ID3Object* self, ID3_Field* field );
+static int payload_read( ID3Object* self, const deferred_payload* ref, void* buf );
+static void* payload_fetch( ID3Object* self, const deferred_payload* ref );
+static int payload_hash( ID3Object* self, const deferred_payload* ref,
+			 unsigned long long seed, unsigned long long* digest );
+static size_t binary_size( ID3Object* owner, ID3_Field* field );
+static void payload_table_clear( ID3Object* self );
+static void frame_drop( ID3Object* self, ID3_Frame* frame );
+static int id3_load_payloads( ID3Object* self );
+static void id3_defer_payloads( ID3Object* self );
 
 static PyObject* id3_iter( ID3Object* self );
 static void id3iter_dealloc( ID3IterObject* self );
 static PyObject* id3iter_getiter( PyObject* self );
 static PyObject* id3iter_iternext( ID3IterObject* self );
 
+static PyObject* id3_scan( PyObject* self, PyObject* args, PyObject* kwds );
+static void id3scan_dealloc( ID3ScanObject* self );
+static PyObject* id3scan_getiter( PyObject* self );
+static PyObject* id3scan_iternext( ID3ScanObject* self );
+static PyObject* id3scan_next_tag( ID3ScanObject* self );
+
+static PyObject* stats_get( PyObject* self );
+static PyObject* stats_reset( PyObject* self );
+static PyObject* stats_histograms( PyObject* self );
+static PyObject* set_slow_hook( PyObject* self, PyObject* args );
+static void slow_hook_check( const char* filename, const phase_times* times,
+			     ID3Object* id3obj );
+
+// module-wide objects.  these are all created in initpyid3lib() and
+// never change afterwards (frameid_info below is the one exception,
+// and is only filled in while holding the interpreter lock), so it's
+// safe for every interpreter in the process to share them.
+
 static PyObject* frame_id_key_obj;
 static PyObject* field_keys[ID3FN_LASTFIELDID+1];
 
-static PyObject* dict_from_frame( ID3_Frame* frame );
+static PyObject* dict_from_frame( ID3Object* owner, ID3_Frame* frame );
 static ID3_Frame* frame_from_dict( PyObject* dict );
 static ID3_Frame* frame_from_dict( ID3_FrameID fid, PyObject* dict );
 
@@ -68,15 +248,36 @@ static int id3_ass_item( ID3Object* self, int index, PyObject* dict );
 static int id3_ass_slice( ID3Object* self, int start, int end, PyObject* dict );
 static int id3_contains( ID3Object* self, PyObject* other );
 
-static PyObject* id3_append( ID3Object* self, PyObject* args );
-static PyObject* id3_extend( ID3Object* self, PyObject* args );
-static PyObject* id3_count( ID3Object* self, PyObject* args );
-static PyObject* id3_index( ID3Object* self, PyObject* args );
+static PyObject* id3_append( ID3Object* self, PyObject* dict );
+static PyObject* id3_extend( ID3Object* self, PyObject* dictseq );
+static PyObject* id3_count( ID3Object* self, PyObject* other );
+static PyObject* id3_index( ID3Object* self, PyObject* other );
 static PyObject* id3_insert( ID3Object* self, PyObject* args );
 static PyObject* id3_pop( ID3Object* self, PyObject* args );
-static PyObject* id3_remove( ID3Object* self, PyObject* args );
+static PyObject* id3_remove( ID3Object* self, PyObject* other );
+
+static PyObject* id3_diff( ID3Object* self, PyObject* other );
+static int frames_equal( ID3Object* oa, ID3_Frame* a, ID3Object* ob, ID3_Frame* b );
+static PyObject* id3_patch( ID3Object* self, PyObject* ops );
+static PyObject* id3_digest( ID3Object* self, PyObject* args );
+static void id3_compute_digests( ID3Object* self );
+static void digest_cache_clear( ID3Object* self );
+static PyObject* id3_audio_digest( ID3Object* self );
+static PyObject* audio_digests( PyObject* self, PyObject* args, PyObject* kwds );
+static PyObject* id3_stream_info( ID3Object* self );
+static PyObject* id3_extract( ID3Object* self, PyObject* args );
+static PyObject* extract_pictures( PyObject* self, PyObject* args, PyObject* kwds );
+static PyObject* id3_render_tag( ID3Object* self );
+static PyObject* stream_file( PyObject* self, PyObject* args );
+static void id3_compute_stream( ID3Object* self );
 
-static PyObject* frameid_lookup = NULL;
+static PyObject* frameid_info[ID3FID_LASTFRAMEID];
+
+static int frameid_from_object( PyObject* obj, ID3_FrameID* fid );
+
+static int id3_reserve( ID3Object* self, int n );
+static void frame_array_get( ID3Object* self );
+static void frame_array_put( ID3Object* self );
 
 
 static PySequenceMethods tag_as_sequence = {
@@ -94,17 +295,33 @@ static PySequenceMethods tag_as_sequence = {
 
 static PyMethodDef id3_methods[] = {
     { "update", (PyCFunction)id3_update, METH_NOARGS },
+    { "reopen", (PyCFunction)id3_reopen, METH_VARARGS | METH_KEYWORDS },
 
     // standard sequence methods
-    { "append", (PyCFunction)id3_append, METH_VARARGS },
-    { "extend", (PyCFunction)id3_extend, METH_VARARGS },
-    { "count", (PyCFunction)id3_count, METH_VARARGS },
-    { "index", (PyCFunction)id3_index, METH_VARARGS },
+    { "append", (PyCFunction)id3_append, METH_O },
+    { "extend", (PyCFunction)id3_extend, METH_O },
+    { "count", (PyCFunction)id3_count, METH_O },
+    { "index", (PyCFunction)id3_index, METH_O },
     { "insert", (PyCFunction)id3_insert, METH_VARARGS },
     { "pop", (PyCFunction)id3_pop, METH_VARARGS },
-    { "remove", (PyCFunction)id3_remove, METH_VARARGS },
+    { "remove", (PyCFunction)id3_remove, METH_O },
+
+    { "diff", (PyCFunction)id3_diff, METH_O },
+    { "patch", (PyCFunction)id3_patch, METH_O },
+    { "digest", (PyCFunction)id3_digest, METH_VARARGS },
+    { "audio_digest", (PyCFunction)id3_audio_digest, METH_NOARGS },
+    { "stream_info", (PyCFunction)id3_stream_info, METH_NOARGS },
+    { "extract", (PyCFunction)id3_extract, METH_VARARGS },
+    { "render", (PyCFunction)id3_render_tag, METH_NOARGS },
+
+    { "__sizeof__", (PyCFunction)id3_sizeof, METH_NOARGS },
     { NULL, NULL }
 };
+
+static PyGetSetDef id3_getset[] = {
+    { "dirty", (getter)id3_get_dirty, NULL },
+    { NULL }
+};
     
 
 PyTypeObject ID3Type = {
@@ -115,8 +332,8 @@ PyTypeObject ID3Type = {
     0,
     (destructor)id3_dealloc,           // tp_dealloc
     0,                                 // tp_print
-    (getattrfunc)id3_getattr,          // tp_getattr
-    (setattrfunc)id3_setattr,          // tp_setattr
+    0,                                 // tp_getattr
+    0,                                 // tp_setattr
     0,                                 // tp_compare
     0,                                 // tp_repr
     0,                                 // tp_as_number
@@ -125,8 +342,8 @@ PyTypeObject ID3Type = {
     0,                                 // tp_hash
     0,                                 // tp_call 
     0,                                 // tp_str 
-    0,                                 // tp_getattro 
-    0,                                 // tp_setattro 
+    (getattrofunc)id3_getattro,        // tp_getattro 
+    (setattrofunc)id3_setattro,        // tp_setattro 
     0,                                 // tp_as_buffer 
     Py_TPFLAGS_DEFAULT,                // tp_flags 
     0,                                 // tp_doc 
@@ -136,7 +353,9 @@ PyTypeObject ID3Type = {
     0,                                 // tp_weaklistoffset 
     (getiterfunc)id3_iter,             // tp_iter 
     0,                                 // tp_iternext
-    id3_methods,
+    id3_methods,                       // tp_methods
+    0,                                 // tp_members
+    id3_getset,                        // tp_getset
 };
 
 static PyMethodDef id3iter_methods[] = {
@@ -182,6 +401,49 @@ PyTypeObject ID3IterType = {
     0, 				       // tp_descr_set 
 };
 
+static PyMethodDef id3scan_methods[] = {
+    { "next", (PyCFunction)id3scan_iternext, METH_NOARGS },
+    { NULL, NULL }
+};
+
+PyTypeObject ID3ScanType = {
+    PyObject_HEAD_INIT(&PyType_Type)
+    0,
+    MODULE_NAME ".scan-iterator",
+    sizeof( ID3ScanObject ),
+    0,
+    (destructor)id3scan_dealloc,       // tp_dealloc
+    0,                                 // tp_print
+    0,                                 // tp_getattr
+    0,                                 // tp_setattr
+    0,                                 // tp_compare
+    0,                                 // tp_repr
+    0,                                 // tp_as_number
+    0,                                 // tp_as_sequence
+    0,                                 // tp_as_mapping
+    0,                                 // tp_hash
+    0,                                 // tp_call 
+    0,                                 // tp_str 
+    PyObject_GenericGetAttr,           // tp_getattro 
+    0,                                 // tp_setattro 
+    0,                                 // tp_as_buffer 
+    Py_TPFLAGS_DEFAULT,                // tp_flags 
+    0,                                 // tp_doc 
+    0,                                 // tp_traverse 
+    0,                                 // tp_clear 
+    0,                                 // tp_richcompare 
+    0,                                 // tp_weaklistoffset 
+    (getiterfunc)id3scan_getiter,      // tp_iter 
+    (iternextfunc)id3scan_iternext,    // tp_iternext 
+    id3scan_methods, 		       // tp_methods 
+    0, 				       // tp_members 
+    0, 				       // tp_getset 
+    0, 				       // tp_base 
+    0, 				       // tp_dict 
+    0, 				       // tp_descr_get 
+    0, 				       // tp_descr_set 
+};
+
 static PyObject* id3_iter( ID3Object* self )
 {
     ID3IterObject* it;
@@ -212,6 +474,8 @@ static PyObject* id3iter_getiter( PyObject* self )
 
 static PyObject* id3iter_iternext( ID3IterObject* self )
 {
+    CHECK_NOT_BUSY( self->id3_obj, NULL );
+
     if ( self->tagiter_done )
 	return NULL;
 
@@ -227,696 +491,3339 @@ static PyObject* id3iter_iternext( ID3IterObject* self )
 	return NULL;
     }
 
-    return dict_from_frame( self->id3_obj->frames[self->pos++] );
+    return dict_from_frame( self->id3_obj, self->id3_obj->frames[self->pos++] );
 }
 
 /////////////////
 //
-//   tp_as_sequence methods
+//   performance counters
 //
 /////////////////
 
-static int id3_length( ID3Object* self )
+// cumulative counts of where the module spends its effort, for
+// pyid3lib.stats(), along with a histogram of how long each phase of
+// reading and writing files takes.  every thread that counts
+// something gets its own block, and only that thread ever writes its
+// counters, so they need no locking or shared cache lines.  they are
+// still read and written as relaxed atomics, which cost nothing extra
+// but mean a total never picks up a half-written value.  the lock is
+// only taken to add a thread's block to the list, to add up the
+// totals, to reset them, and when a thread exits and its counts are
+// folded into stat_retired.
+
+enum
 {
-    return self->size;
+    STAT_FILES_OPENED,
+    STAT_TAG_BYTES,
+    STAT_PARSE_TIME,        // nanoseconds
+    STAT_FRAMES_LOADED,
+    STAT_DICTS_BUILT,
+    STAT_BINARY_BYTES,
+    STAT_UPDATES_IN_PLACE,
+    STAT_UPDATES_REWRITTEN,
+    STAT_BYTES_WRITTEN,
+    NUM_STATS
+};
+
+static const char* stat_names[NUM_STATS] = {
+    "files_opened",
+    "tag_bytes",
+    "parse_time",
+    "frames_loaded",
+    "dicts_built",
+    "binary_bytes",
+    "updates_in_place",
+    "updates_rewritten",
+    "bytes_written",
+};
+
+static const char* phase_names[NUM_PHASES] = {
+    "link",
+    "extract",
+    "update",
+};
+
+// histogram bucket i counts times of at least 2**(i-1) but under
+// 2**i microseconds; the last one also takes everything longer.
+
+#define HIST_BUCKETS 32
+
+typedef struct stat_block
+{
+    unsigned long long count[NUM_STATS];
+    unsigned long long hist[NUM_PHASES][HIST_BUCKETS];
+
+    // what count and hist held at the last reset_stats(), which
+    // leaves the counters themselves alone so that it never races
+    // with the thread bumping them.  only used with the lock held.
+    unsigned long long count_base[NUM_STATS];
+    unsigned long long hist_base[NUM_PHASES][HIST_BUCKETS];
+    
+    struct stat_block* next;
+} stat_block;
+
+static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stat_key;
+static stat_block* stat_blocks = NULL;
+static stat_block stat_retired;
+
+#define STAT_LOAD( counter )  __atomic_load_n( &(counter), __ATOMIC_RELAXED )
+
+// the owning thread is the only writer, so a load and a store are
+// enough; no locked read-modify-write is needed.
+
+static inline void stat_bump( unsigned long long* counter, unsigned long long n )
+{
+    __atomic_store_n( counter, __atomic_load_n( counter, __ATOMIC_RELAXED ) + n,
+		      __ATOMIC_RELAXED );
 }
 
-static PyObject* id3_item( ID3Object* self, int index )
+static void stat_thread_exit( void* arg )
 {
-    if ( index < 0 )
-	index += self->size;
+    stat_block* block = (stat_block*)arg;
+    stat_block** p;
+    int i;
 
-    if ( index < 0 || index >= self->size )
+    pthread_mutex_lock( &stat_mutex );
+    for ( i = 0; i < NUM_STATS; ++i )
+	stat_bump( &stat_retired.count[i], block->count[i] - block->count_base[i] );
+    for ( i = 0; i < NUM_PHASES * HIST_BUCKETS; ++i )
+	stat_bump( &stat_retired.hist[0][i], block->hist[0][i] - block->hist_base[0][i] );
+    for ( p = &stat_blocks; *p != block; p = &(*p)->next )
+	;
+    *p = block->next;
+    pthread_mutex_unlock( &stat_mutex );
+
+    free( block );
+}
+
+static stat_block* stat_thread_block( void )
+{
+    stat_block* block = (stat_block*)pthread_getspecific( stat_key );
+
+    if ( block == NULL )
     {
-	PyErr_SetString( PyExc_IndexError, "frame index out of range" );
-	return NULL;
+	block = (stat_block*)calloc( 1, sizeof( stat_block ) );
+	if ( block == NULL )
+	    return &stat_retired;       // lose a little accuracy rather than crash
+	
+	pthread_mutex_lock( &stat_mutex );
+	block->next = stat_blocks;
+	stat_blocks = block;
+	pthread_mutex_unlock( &stat_mutex );
+	
+	pthread_setspecific( stat_key, block );
     }
 
-    return dict_from_frame( self->frames[index] );
+    return block;
 }
 
-static PyObject* id3_slice( ID3Object* self, int start, int end )
+#define STAT_ADD( which, n )  stat_bump( &stat_thread_block()->count[which], (n) )
+
+static unsigned long long stat_clock( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stat_record_phase( stat_block* block, int phase, unsigned long long ns )
+{
+    unsigned long long us = ns / 1000;
+    int bucket = 0;
+
+    while ( us && bucket < HIST_BUCKETS - 1 )
+    {
+	us >>= 1;
+	++bucket;
+    }
+    stat_bump( &block->hist[phase][bucket], 1 );
+}
+
+static PyObject* stats_get( PyObject* self )
 {
+    unsigned long long total[NUM_STATS];
+    stat_block* block;
     PyObject* result;
+    PyObject* item;
     int i;
 
-    if ( start < 0 )
-	start = 0;
-    else if ( start > self->size )
-	start = self->size;
-
-    if ( end < start )
-	end = start;
-    else if ( end > self->size )
-	end = self->size;
+    pthread_mutex_lock( &stat_mutex );
+    for ( i = 0; i < NUM_STATS; ++i )
+	total[i] = STAT_LOAD( stat_retired.count[i] );
+    for ( block = stat_blocks; block; block = block->next )
+	for ( i = 0; i < NUM_STATS; ++i )
+	    total[i] += STAT_LOAD( block->count[i] ) - block->count_base[i];
+    pthread_mutex_unlock( &stat_mutex );
 
-    result = PyList_New( end-start );
+    result = PyDict_New();
     if ( result == NULL )
 	return NULL;
-
-    for ( i = start; i < end; ++i )
+    
+    for ( i = 0; i < NUM_STATS; ++i )
     {
-	PyObject* v = dict_from_frame( self->frames[i] );
-	PyList_SetItem( result, i-start, v );
+	if ( i == STAT_PARSE_TIME )
+	    item = PyFloat_FromDouble( total[i] / 1e9 );
+	else
+	    item = PyLong_FromUnsignedLongLong( total[i] );
+	
+	if ( item == NULL || PyDict_SetItemString( result, stat_names[i], item ) < 0 )
+	{
+	    Py_XDECREF( item );
+	    Py_DECREF( result );
+	    return NULL;
+	}
+	Py_DECREF( item );
     }
 
     return result;
 }
 
+// each increment lands wholly before or after a reset, but a file
+// being loaded at that moment may have some of its counters (say
+// files_opened) fall before the reset and others after it.
 
-static int id3_ass_item( ID3Object* self, int index, PyObject* dict )
+static PyObject* stats_reset( PyObject* self )
 {
-    ID3_Frame* newframe;
+    stat_block* block;
+    int i;
 
-    if ( index < 0 )
-	index += self->size;
-    if ( index < 0 || index >= self->size )
+    pthread_mutex_lock( &stat_mutex );
+    for ( i = 0; i < NUM_STATS; ++i )
+	__atomic_store_n( &stat_retired.count[i], 0, __ATOMIC_RELAXED );
+    for ( i = 0; i < NUM_PHASES * HIST_BUCKETS; ++i )
+	__atomic_store_n( &stat_retired.hist[0][i], 0, __ATOMIC_RELAXED );
+    for ( block = stat_blocks; block; block = block->next )
     {
-	PyErr_SetString( PyExc_IndexError, "frame assignment index out of range" );
-	return -1;
+	for ( i = 0; i < NUM_STATS; ++i )
+	    block->count_base[i] = STAT_LOAD( block->count[i] );
+	for ( i = 0; i < NUM_PHASES * HIST_BUCKETS; ++i )
+	    block->hist_base[0][i] = STAT_LOAD( block->hist[0][i] );
     }
+    pthread_mutex_unlock( &stat_mutex );
 
-    if ( dict == NULL )
-    {
-	// deleting a frame
-	
-	int i;
-	
-	delete self->frames[index];
+    Py_INCREF( Py_None );
+    return Py_None;
+}
 
-	for ( i = index+1; i < self->size; ++i )
-	    self->frames[i-1] = self->frames[i];
-	--self->size;
+static PyObject* stats_histograms( PyObject* self )
+{
+    unsigned long long total[NUM_PHASES][HIST_BUCKETS];
+    stat_block* block;
+    PyObject* result;
+    PyObject* lyst;
+    int i, j;
+
+    pthread_mutex_lock( &stat_mutex );
+    for ( i = 0; i < NUM_PHASES; ++i )
+	for ( j = 0; j < HIST_BUCKETS; ++j )
+	    total[i][j] = STAT_LOAD( stat_retired.hist[i][j] );
+    for ( block = stat_blocks; block; block = block->next )
+	for ( i = 0; i < NUM_PHASES; ++i )
+	    for ( j = 0; j < HIST_BUCKETS; ++j )
+		total[i][j] += STAT_LOAD( block->hist[i][j] ) - block->hist_base[i][j];
+    pthread_mutex_unlock( &stat_mutex );
 
-	return 0;
-    }
-    
-    if ( !PyDict_Check( dict ) )
+    result = PyDict_New();
+    if ( result == NULL )
+	return NULL;
+
+    for ( i = 0; i < NUM_PHASES; ++i )
     {
-	PyErr_SetString( ID3Error, "frame assignment must be from dictionary" );
-	return -1;
-    }
-    
-    newframe = frame_from_dict( dict );
-    if ( newframe == NULL )
-	return -1;
+	lyst = PyList_New( HIST_BUCKETS );
+	if ( lyst == NULL )
+	{
+	    Py_DECREF( result );
+	    return NULL;
+	}
+	for ( j = 0; j < HIST_BUCKETS; ++j )
+	    PyList_SET_ITEM( lyst, j, PyLong_FromUnsignedLongLong( total[i][j] ) );
 
-    delete self->frames[index];
-    self->frames[index] = newframe;
+	PyDict_SetItemString( result, phase_names[i], lyst );
+	Py_DECREF( lyst );
+    }
 
-    return 0;
+    return result;
 }
 
-static ID3_Frame** frames_from_dictseq( PyObject* dictseq, int *count )
+/////////////////
+//
+//   slow file hook
+//
+/////////////////
+
+// an optional callback, run whenever loading or saving a single file
+// takes longer than slow_threshold.  the timing is done wherever the
+// work happens, but the hook itself is only ever called by the thread
+// that hands the result back to Python, with the interpreter lock held.
+
+static PyObject* slow_hook = NULL;
+static unsigned long long slow_threshold = 0;
+
+static PyObject* set_slow_hook( PyObject* self, PyObject* args )
 {
-    ID3_Frame** newframes;
-    PyObject* dict;
-    int i, n;
-    
-    if ( !PySequence_Check( dictseq ) )
-    {
-	PyErr_SetString( ID3Error, "slice assignment must be from sequence of dictionaries" );
-	*count = -1;
+    PyObject* hook;
+    double threshold = 1.0;
+
+    if ( !PyArg_ParseTuple( args, "O|d:set_slow_hook", &hook, &threshold ) )
 	return NULL;
-    }
 
-    n = PySequence_Size( dictseq );
-    if ( n == 0 )
+    if ( hook != Py_None && !PyCallable_Check( hook ) )
     {
-	*count = 0;
+	PyErr_SetString( PyExc_TypeError, "set_slow_hook() argument must be callable or None" );
 	return NULL;
     }
-    
-    newframes = new ID3_Frame* [n];
-    for ( i = 0; i < n; ++i )
-	newframes[i] = NULL;
-	
-    for ( i = 0; i < n; ++i )
+    if ( threshold < 0 )
     {
-	dict = PySequence_GetItem( dictseq, i );
-	if ( !PyDict_Check( dict ) )
-	{
-	    PyErr_SetString( ID3Error, "slice assignment must be from sequence of dictionaries" );
-	    Py_DECREF( dict );
-	    goto abort;
-	}
-
-	newframes[i] = frame_from_dict( dict );
-	Py_DECREF( dict );
-	if ( newframes[i] == NULL )
-	    goto abort;
+	PyErr_SetString( PyExc_ValueError, "set_slow_hook() threshold must not be negative" );
+	return NULL;
     }
 
-    *count = n;
-    return newframes;
-    
-    
-    abort:
-    
-    for( i = 0; i < n; ++i )
-	if ( newframes[i] )
-	    delete newframes[i];
-    delete [] newframes;
+    Py_XDECREF( slow_hook );
+    slow_hook = NULL;
+    if ( hook != Py_None )
+    {
+	Py_INCREF( hook );
+	slow_hook = hook;
+    }
+    slow_threshold = (unsigned long long)(threshold * 1e9);
 
-    *count = -1;
-    return NULL;
+    Py_INCREF( Py_None );
+    return Py_None;
 }
 
-static int id3_ass_slice( ID3Object* self, int start, int end, PyObject* dictseq )
+// the hook is called as hook( filename, {phase: seconds}, tag size,
+// number of frames ).  it's there for tracing, so anything it raises
+// is reported and then ignored rather than failing the load.
+
+static void slow_hook_check( const char* filename, const phase_times* times,
+			     ID3Object* id3obj )
 {
-    int i, n;
-    int newsize;
-    ID3_Frame** newframes;
-	
-    if ( start < 0 )
-	start = 0;
-    else if ( start > self->size )
-	start = self->size;
+    unsigned long long total = 0;
+    PyObject* hook;
+    PyObject* phases;
+    PyObject* item;
+    PyObject* result;
+    int i;
 
-    if ( end < start )
-	end = start;
-    else if ( end > self->size )
-	end = self->size;
+    if ( slow_hook == NULL )
+	return;
+
+    for ( i = 0; i < NUM_PHASES; ++i )
+	total += times->ns[i];
+    if ( total < slow_threshold )
+	return;
 
-    if ( dictseq == NULL )
+    // the hook can replace itself with set_slow_hook() (as can any
+    // Python code that runs while we build its arguments), so hold on
+    // to the one we're calling.
+    hook = slow_hook;
+    Py_INCREF( hook );
+
+    phases = PyDict_New();
+    if ( phases == NULL )
     {
-    deleteslice:
-	for ( i = start; i < end; ++i )
-	    delete self->frames[i];
+	PyErr_WriteUnraisable( hook );
+	Py_DECREF( hook );
+	return;
+    }
+    for ( i = 0; i < NUM_PHASES; ++i )
+	if ( times->ns[i] )
+	{
+	    item = PyFloat_FromDouble( times->ns[i] / 1e9 );
+	    if ( item )
+	    {
+		PyDict_SetItemString( phases, phase_names[i], item );
+		Py_DECREF( item );
+	    }
+	}
 
-	for ( i = end; i < self->size; ++i )
-	    self->frames[i-end+start] = self->frames[i];
-	self->size -= (end-start);
+    result = PyObject_CallFunction( hook, "zOki", filename, phases,
+				    (unsigned long)(id3obj->tag->GetPrependedBytes() +
+						    id3obj->tag->GetAppendedBytes()),
+				    id3obj->size );
+    Py_DECREF( phases );
+    
+    if ( result == NULL )
+	PyErr_WriteUnraisable( hook );
+    Py_XDECREF( result );
+    Py_DECREF( hook );
+}
 
+/////////////////
+//
+//   read-ahead hints
+//
+/////////////////
+
+#define ID3V1_SIZE          128
+#define ID3V2_HEADER_SIZE   10
+#define PREFETCH_HEAD       4096
+
+// total size in bytes of the ID3v2 tag described by a 10-byte header
+// (header and footer included), or 0 if it isn't a valid header.
+
+static long id3v2_tag_size( const unsigned char* hdr )
+{
+    long size;
+    
+    if ( memcmp( hdr, "ID3", 3 ) != 0 ||
+	 ((hdr[6] | hdr[7] | hdr[8] | hdr[9]) & 0x80) )
 	return 0;
-    }
 
-    // first, try to create frames from dictseq
+    size = ((long)hdr[6] << 21) | ((long)hdr[7] << 14) | ((long)hdr[8] << 7) | hdr[9];
+    size += ID3V2_HEADER_SIZE;
+    if ( hdr[3] == 4 && (hdr[5] & 0x10) )
+	size += ID3V2_HEADER_SIZE;
 
-    newframes = frames_from_dictseq( dictseq, &n );
-    if ( newframes == NULL )
+    return size;
+}
+
+// where the audio lies in an open file of the given size: after the
+// ID3v2 tag at the front and before the ID3v1 tag at the end.  found
+// from the headers alone, so the answer is the same whichever tag
+// versions a tag object was opened with.
+
+static void audio_bounds( int fd, unsigned long long size,
+			  unsigned long long* start, unsigned long long* end )
+{
+    unsigned char hdr[ID3V2_HEADER_SIZE];
+
+    *start = 0;
+    *end = size;
+    if ( pread( fd, hdr, sizeof( hdr ), 0 ) == sizeof( hdr ) )
+	*start = id3v2_tag_size( hdr );
+    if ( size >= ID3V1_SIZE && pread( fd, hdr, 3, size - ID3V1_SIZE ) == 3 &&
+	 memcmp( hdr, "TAG", 3 ) == 0 )
+	*end -= ID3V1_SIZE;
+    if ( *start > *end )
+	*start = *end;
+}
+
+// ask the kernel to start reading the parts of each file that id3lib
+// is going to look at: the first page, which holds the ID3v2 header
+// and usually the whole tag, and the ID3v1 tag in the last 128 bytes.
+// these are only hints, so nothing here waits on the disk -- the
+// consumer runs this before the workers see the jobs, and reading a
+// header here would hold every one of them up behind the slowest file.
+// the rest of a bigger ID3v2 tag is left to the kernel's own
+// read-ahead when id3lib gets to it.  nothing here touches Python.
+
+static void prefetch_tags( const char** names, int n )
+{
+    struct stat st;
+    int fd, i;
+
+    for ( i = 0; i < n; ++i )
     {
-	if ( n == 0 )
-	    goto deleteslice;    // sequence was empty
-	else
-	    return -1;           // some error occurred in reading dictseq
+	fd = open( names[i], O_RDONLY );
+	if ( fd < 0 )
+	    continue;
+	
+	posix_fadvise( fd, 0, PREFETCH_HEAD, POSIX_FADV_WILLNEED );
+	if ( fstat( fd, &st ) == 0 && st.st_size > ID3V1_SIZE )
+	    posix_fadvise( fd, st.st_size - ID3V1_SIZE, ID3V1_SIZE, POSIX_FADV_WILLNEED );
+	close( fd );
     }
+}
+
+// the same regions, for a single file that is about to be loaded.
+// cache_hint_begin() asks for them to be read in; cache_hint_end()
+// tells the kernel we won't want them again, so a sweep over a whole
+// library doesn't push everything else out of the page cache.
+//
+// the advice has to go through our own descriptor, since id3lib
+// doesn't let us at its stream.  WILLNEED and DONTNEED act on the
+// file's cached pages, whoever opened it, so that's enough.  (RANDOM
+// only changes read-ahead for the descriptor it's given, which would
+// be ours, so it's no use here.)  the audio in between is never
+// touched, and so never dropped.
+
+#define PREFETCH_TAIL       4096
+
+typedef struct
+{
+    int fd;
+    off_t head;             // bytes at the front: ID3v2 tag and first frame header
+    off_t tail;             // offset of the appended tags at the end
+} cache_hint;
+
+static void cache_hint_begin( cache_hint* hint, const char* filename )
+{
+    unsigned char hdr[ID3V2_HEADER_SIZE];
+    struct stat st;
     
-    // hooray, no problems with the caller's value.  start shifting
-    // around existing frames to insert the new ones.
-    
-    newsize = self->size - (end-start) + n;
+    hint->fd = open( filename, O_RDONLY );
+    if ( hint->fd < 0 )
+	return;
 
-    if ( newsize > self->alloc )
+    if ( fstat( hint->fd, &st ) < 0 )
     {
-	self->alloc = newsize;
-	self->frames = (ID3_Frame**)realloc( self->frames,
-					     self->alloc * sizeof( ID3_Frame* ) );
+	close( hint->fd );
+	hint->fd = -1;
+	return;
     }
+    
+    hint->head = PREFETCH_HEAD;
+    if ( pread( hint->fd, hdr, sizeof( hdr ), 0 ) == sizeof( hdr ) )
+	hint->head += id3v2_tag_size( hdr );
+    if ( hint->head > st.st_size )
+	hint->head = st.st_size;
+    
+    hint->tail = st.st_size > PREFETCH_TAIL ? st.st_size - PREFETCH_TAIL : 0;
+    if ( hint->tail < hint->head )
+	hint->tail = hint->head;
 
-    if ( newsize >= self->size )
-    {
-	// shift frames after "end" to the right
-	for ( i = self->size-1; i >= end; --i )
-	    self->frames[i + n - end + start] = self->frames[i];
-    }
-    else
-    {
-	// shift frames after "end" to the left
-	for ( i = end; i < self->size; ++i )
-	    self->frames[i + n - end + start] = self->frames[i];
-    }
-    for ( i = 0; i < n; ++i )
-	self->frames[start + i] = newframes[i];
-    delete [] newframes;
-    self->size = newsize;
+    posix_fadvise( hint->fd, 0, hint->head, POSIX_FADV_WILLNEED );
+    if ( hint->tail < st.st_size )
+	posix_fadvise( hint->fd, hint->tail, 0, POSIX_FADV_WILLNEED );
+}
 
-    return 0;
+static void cache_hint_end( cache_hint* hint )
+{
+    if ( hint->fd < 0 )
+	return;
+
+    posix_fadvise( hint->fd, 0, hint->head, POSIX_FADV_DONTNEED );
+    posix_fadvise( hint->fd, hint->tail, 0, POSIX_FADV_DONTNEED );
+    close( hint->fd );
 }
 
 /////////////////
 //
-//   explicit mutable sequence methods
+//   on-disk ordering
 //
 /////////////////
 
-static int id3_contains( ID3Object* self, PyObject* other )
-{
-    int i;
-    
-    if ( !PyString_Check( other ) )
-    {
-	PyErr_SetString( ID3Error, "'in <tag>' requires string as left operand" );
-	return -1;
-    }
+// on a rotating disk, visiting files in directory order means a seek
+// between every pair of files.  to avoid that, scan() can sort the
+// files by where they live on disk before opening any of them:
+// grouped by device, then by the physical address of their first
+// extent (from FIEMAP), or by inode number when that isn't available
+// or wasn't asked for.
 
-    PyObject* tuple;
-    tuple = PyDict_GetItem( frameid_lookup, other );
-    if ( tuple == NULL )
-    {
-	PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
-		      PyString_AsString( other ) );
-	return -1;
-    }
+enum { ORDER_NONE, ORDER_INODE, ORDER_EXTENT };
 
-    ID3_FrameID fid = (ID3_FrameID)PyInt_AsLong( PyTuple_GetItem( tuple, 0 ) );
+typedef struct
+{
+    unsigned long long dev;
+    unsigned long long phys;
+    unsigned long long ino;
+    long index;
+} disk_position;
 
-    for ( i = 0; i < self->size; ++i )
-	if ( self->frames[i]->GetID() == fid )
-	    return 1;
+static int disk_position_compare( const void* a, const void* b )
+{
+    const disk_position* x = (const disk_position*)a;
+    const disk_position* y = (const disk_position*)b;
+
+    if ( x->dev != y->dev )
+	return x->dev < y->dev ? -1 : 1;
+    if ( x->phys != y->phys )
+	return x->phys < y->phys ? -1 : 1;
+    if ( x->ino != y->ino )
+	return x->ino < y->ino ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
 
+static unsigned long long first_extent( int fd )
+{
+#ifdef FS_IOC_FIEMAP
+    // room for the header and a single extent
+    unsigned long long buf[(sizeof( struct fiemap ) + sizeof( struct fiemap_extent ) + 7) / 8];
+    struct fiemap* fm = (struct fiemap*)buf;
+
+    memset( buf, 0, sizeof( buf ) );
+    fm->fm_length = ~0ULL;
+    fm->fm_extent_count = 1;
+    if ( ioctl( fd, FS_IOC_FIEMAP, fm ) == 0 && fm->fm_mapped_extents > 0 )
+	return fm->fm_extents[0].fe_physical;
+#endif
     return 0;
 }
 
-static PyObject* id3_append( ID3Object* self, PyObject* args )
-{
-    PyObject* dict;
+// fill in pos[i] for each of the n files, then sort.  files that
+// can't be looked at sort to the front, in their original order, and
+// fail later when they're actually opened.  nothing here touches
+// Python.
 
-    if ( !PyArg_ParseTuple( args, "O", &dict ) )
-	return NULL;
-    Py_INCREF( dict );
+static void sort_by_disk_position( const char** names, disk_position* pos,
+				   long n, int order )
+{
+    struct stat st;
+    long i;
+    int fd;
 
-    if ( !PyDict_Check( dict ) )
+    for ( i = 0; i < n; ++i )
     {
-	PyErr_SetString( ID3Error, "frame append must be from dictionary" );
-	Py_DECREF( dict );
-	return NULL;
-    }
-    
-    ID3_Frame* newframe = frame_from_dict( dict );
-    Py_DECREF( dict );
-    if ( newframe == NULL )
-	return NULL;
+	pos[i].dev = pos[i].phys = pos[i].ino = 0;
+	pos[i].index = i;
 
-    if ( self->size + 1 > self->alloc )
-    {
-	self->alloc += 8;
-	self->frames = (ID3_Frame**)realloc( self->frames, self->alloc * sizeof( ID3_Frame* ) );
+	if ( order == ORDER_EXTENT )
+	{
+	    fd = open( names[i], O_RDONLY );
+	    if ( fd < 0 )
+		continue;
+	    if ( fstat( fd, &st ) == 0 )
+	    {
+		pos[i].dev = st.st_dev;
+		pos[i].ino = st.st_ino;
+		pos[i].phys = first_extent( fd );
+	    }
+	    close( fd );
+	}
+	else if ( stat( names[i], &st ) == 0 )
+	{
+	    pos[i].dev = st.st_dev;
+	    pos[i].ino = st.st_ino;
+	}
     }
 
-    self->frames[self->size++] = newframe;
-
-    Py_INCREF( Py_None );
-    return Py_None;
+    qsort( pos, n, sizeof( disk_position ), disk_position_compare );
 }
 
-static PyObject* id3_extend( ID3Object* self, PyObject* args )
+// replace the scan's filename iterator with one over the same names
+// in on-disk order, remembering where each one came from.
+
+static int scan_set_order( ID3ScanObject* it, PyObject* seq, int order )
 {
-    PyObject* dictseq;
-    int i, n;
-    ID3_Frame** newframes;
+    PyObject* list;
+    PyObject* sorted;
+    PyObject* name;
+    const char** names;
+    disk_position* pos;
+    long i, n;
+
+    list = PySequence_List( seq );
+    if ( list == NULL )
+	return -1;
+    
+    n = PyList_GET_SIZE( list );
+    for ( i = 0; i < n; ++i )
+	if ( !PyString_Check( PyList_GET_ITEM( list, i ) ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "scan() requires a sequence of filenames" );
+	    Py_DECREF( list );
+	    return -1;
+	}
 
-    if ( !PyArg_ParseTuple( args, "O", &dictseq ) )
-	return NULL;
-    Py_INCREF( dictseq );
+    names = new const char* [n];
+    pos = new disk_position [n];
+    for ( i = 0; i < n; ++i )
+	names[i] = PyString_AS_STRING( PyList_GET_ITEM( list, i ) );
 
-    newframes = frames_from_dictseq( dictseq, &n );
-    Py_DECREF( dictseq );
+    Py_BEGIN_ALLOW_THREADS
+    sort_by_disk_position( names, pos, n, order );
+    Py_END_ALLOW_THREADS
 
-    if ( newframes == NULL )
+    sorted = PyList_New( n );
+    it->order = (long*)malloc( (n > 0 ? n : 1) * sizeof( long ) );
+    if ( sorted == NULL || it->order == NULL )
     {
-	if ( n == 0 )
-	    goto done;    // sequence was empty
-	else
-	    return NULL;  // error processing dictseq
+	Py_XDECREF( sorted );
+	Py_DECREF( list );
+	delete [] names;
+	delete [] pos;
+	PyErr_NoMemory();
+	return -1;
     }
-
-    if ( self->size + n > self->alloc )
+    
+    for ( i = 0; i < n; ++i )
     {
-	self->alloc += n;
-	self->frames = (ID3_Frame**)realloc( self->frames, self->alloc * sizeof( ID3_Frame* ) );
+	name = PyList_GET_ITEM( list, pos[i].index );
+	Py_INCREF( name );
+	PyList_SET_ITEM( sorted, i, name );
+	it->order[i] = pos[i].index;
     }
+    Py_DECREF( list );
+    delete [] names;
+    delete [] pos;
 
-    for ( i = 0; i < n; ++i )
-	self->frames[self->size + i] = newframes[i];
-    self->size += n;
-    delete [] newframes;
+    Py_XDECREF( it->names );
+    it->names = PyObject_GetIter( sorted );
+    Py_DECREF( sorted );
 
- done:
-    Py_INCREF( Py_None );
-    return Py_None;
-    
+    return it->names == NULL ? -1 : 0;
 }
 
-static PyObject* id3_count( ID3Object* self, PyObject* args )
-{
-    int i, c;
-    PyObject* other;
+/////////////////
+//
+//   scanning a batch of files
+//
+/////////////////
 
-    if ( !PyArg_ParseTuple( args, "O!", &PyString_Type, &other ) )
-	return NULL;
-    Py_INCREF( other );
+// with threads > 0, scan() keeps a ring of jobs queued ahead of the
+// caller, and a pool of native threads loads them in the background.
+// each job owns an ID3_Tag and frame array (held in an ID3Object that
+// is never exposed to Python).  when the caller reaches a job, its
+// contents are swapped with those of the tag object being returned,
+// so the same handles keep circulating between the pool and the
+// caller.
 
-    PyObject* tuple;
-    tuple = PyDict_GetItem( frameid_lookup, other );
-    Py_DECREF( other );
-    if ( tuple == NULL )
+#define SCAN_MAX_THREADS     64
+#define SCAN_JOBS_PER_THREAD 4
+
+static void* scan_worker( void* arg )
+{
+    ID3ScanObject* it = (ID3ScanObject*)arg;
+    scan_job* job;
+
+    pthread_mutex_lock( &it->mutex );
+    for ( ;; )
     {
-	PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
-		      PyString_AsString( other ) );
-	return NULL;
-    }
+	while ( it->taken == it->queued && !it->shutdown )
+	    pthread_cond_wait( &it->work_cond, &it->mutex );
+	if ( it->shutdown )
+	    break;
 
-    ID3_FrameID fid = (ID3_FrameID)PyInt_AsLong( PyTuple_GetItem( tuple, 0 ) );
+	job = &it->jobs[it->taken++ % it->njobs];
+	pthread_mutex_unlock( &it->mutex );
 
-    c = 0;
-    for ( i = 0; i < self->size; ++i )
-	if ( self->frames[i]->GetID() == fid )
-	    ++c;
+	job->failed = id3_read_file( &job->shell, PyString_AS_STRING( job->name ), &it->load,
+				     &job->times ) < 0;
+	if ( it->streams )
+	    id3_compute_stream( &job->shell );
 
-    return PyInt_FromLong( c );
+	pthread_mutex_lock( &it->mutex );
+	job->state = JOB_DONE;
+	if ( it->waiting )
+	    pthread_cond_signal( &it->done_cond );
+    }
+    pthread_mutex_unlock( &it->mutex );
+
+    return NULL;
 }
 
-static PyObject* id3_index( ID3Object* self, PyObject* args )
+static int scan_pool_start( ID3ScanObject* it, int nthreads )
 {
     int i;
-    PyObject* other;
-
-    if ( !PyArg_ParseTuple( args, "O!", &PyString_Type, &other ) )
-	return NULL;
-    Py_INCREF( other );
     
-    PyObject* tuple;
-    tuple = PyDict_GetItem( frameid_lookup, other );
-    Py_DECREF( other );
-    if ( tuple == NULL )
+    it->njobs = nthreads * SCAN_JOBS_PER_THREAD;
+    it->jobs = new scan_job [it->njobs];
+    for ( i = 0; i < it->njobs; ++i )
     {
-	PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
-		      PyString_AsString( other ) );
-	return NULL;
+	it->jobs[i].name = NULL;
+	it->jobs[i].state = JOB_DONE;
+	it->jobs[i].shell.tag = tag_get();
+	it->jobs[i].shell.busy = 0;
+	it->jobs[i].shell.dirty = 0;
+	it->jobs[i].shell.digests = NULL;
+	it->jobs[i].shell.stream = NULL;
+	it->jobs[i].shell.versions = ID3TT_ALL;
+	it->jobs[i].shell.ondisk = 0;
+	it->jobs[i].shell.filename = NULL;
+	it->jobs[i].shell.maxbinary = 0;
+	it->jobs[i].shell.deferred = NULL;
+	frame_array_get( &it->jobs[i].shell );
     }
+    it->queued = it->taken = it->delivered = it->ready = 0;
+    it->names_done = it->shutdown = it->waiting = 0;
+    
+    pthread_mutex_init( &it->mutex, NULL );
+    pthread_cond_init( &it->work_cond, NULL );
+    pthread_cond_init( &it->done_cond, NULL );
 
-    ID3_FrameID fid = (ID3_FrameID)PyInt_AsLong( PyTuple_GetItem( tuple, 0 ) );
-
-    for ( i = 0; i < self->size; ++i )
-	if ( self->frames[i]->GetID() == fid )
-	    return PyInt_FromLong( i );
+    it->threads = new pthread_t [nthreads];
+    for ( it->nthreads = 0; it->nthreads < nthreads; ++it->nthreads )
+	if ( pthread_create( &it->threads[it->nthreads], NULL, scan_worker, it ) != 0 )
+	    break;
 
-    PyErr_SetString( PyExc_ValueError, "frame id not in tag" );
-    return NULL;
+    return it->nthreads > 0 ? 0 : -1;
 }
 
-static PyObject* id3_insert( ID3Object* self, PyObject* args )
+static void scan_pool_stop( ID3ScanObject* it )
 {
-    PyObject* dict;
-    int i, index;
+    int i, j;
+    
+    pthread_mutex_lock( &it->mutex );
+    it->shutdown = 1;
+    pthread_cond_broadcast( &it->work_cond );
+    pthread_mutex_unlock( &it->mutex );
 
-    if ( !PyArg_ParseTuple( args, "iO", &index, &dict ) )
-	return NULL;
-    Py_INCREF( dict );
+    Py_BEGIN_ALLOW_THREADS
+    for ( i = 0; i < it->nthreads; ++i )
+	pthread_join( it->threads[i], NULL );
+    Py_END_ALLOW_THREADS
 
-    if ( !PyDict_Check( dict ) )
+    for ( i = 0; i < it->njobs; ++i )
     {
-	PyErr_SetString( ID3Error, "frame insert must be from dictionary" );
-	Py_DECREF( dict );
-	return NULL;
+	ID3Object* shell = &it->jobs[i].shell;
+	
+	Py_XDECREF( it->jobs[i].name );
+	for ( j = 0; j < shell->size; ++j )
+	    delete shell->frames[j];
+	payload_table_clear( shell );
+	frame_array_put( shell );
+	digest_cache_clear( shell );
+	free( shell->stream );
+	free( shell->filename );
+	tag_put( shell->tag );
     }
+    delete [] it->jobs;
+    delete [] it->threads;
+    
+    pthread_mutex_destroy( &it->mutex );
+    pthread_cond_destroy( &it->work_cond );
+    pthread_cond_destroy( &it->done_cond );
 
-    ID3_Frame* newframe = frame_from_dict( dict );
-    Py_DECREF( dict );
-    if ( newframe == NULL )
-	return NULL;
+    it->nthreads = 0;
+}
+
+// pull more filenames off the caller's sequence and hand them to the
+// workers, all at once under a single lock.
+
+static int scan_refill( ID3ScanObject* it )
+{
+    PyObject* name;
+    scan_job* job;
+    long added = 0;
+    int result = 0;
 
-    if ( self->size + 1 > self->alloc )
+    while ( !it->names_done && it->queued + added - it->delivered < it->njobs )
     {
-	self->alloc += 8;
-	self->frames = (ID3_Frame**)realloc( self->frames, self->alloc * sizeof( ID3_Frame* ) );
+	name = PyIter_Next( it->names );
+	if ( name == NULL )
+	{
+	    if ( PyErr_Occurred() )
+		result = -1;
+	    else
+		it->names_done = 1;
+	    break;
+	}
+	
+	if ( !PyString_Check( name ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "scan() requires a sequence of filenames" );
+	    Py_DECREF( name );
+	    result = -1;
+	    break;
+	}
+
+	job = &it->jobs[(it->queued + added) % it->njobs];
+	job->name = name;
+	job->state = JOB_QUEUED;
+	++added;
     }
 
-    if ( index < 0 )
-	index = 0;
-    else if ( index > self->size )
-	index = self->size;
+    // hint the new files before the workers can see them, so the
+    // kernel has a head start on every one rather than racing the
+    // worker that is about to open it.
     
-    for ( i = self->size-1; i >= index; --i )
-	self->frames[i+1] = self->frames[i];
-    self->frames[index] = newframe;
-    ++self->size;
-
-    Py_INCREF( Py_None );
-    return Py_None;
-}
+    if ( added > 0 && it->readahead )
+    {
+	const char** names = new const char* [added];
+	long i;
 
-static PyObject* id3_pop( ID3Object* self, PyObject* args )
-{
-    int index = self->size-1;
-    int i;
-    PyObject* result;
+	for ( i = 0; i < added; ++i )
+	    names[i] = PyString_AS_STRING( it->jobs[(it->queued + i) % it->njobs].name );
 
-    if ( !PyArg_ParseTuple( args, "|i", &index ) )
-	return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	prefetch_tags( names, added );
+	Py_END_ALLOW_THREADS
 
-    if ( self->size == 0 )
-    {
-	PyErr_SetString( PyExc_IndexError, "pop from empty tag" );
-	return NULL;
+	delete [] names;
     }
-    
-    if ( index < 0 || index >= self->size )
+
+    if ( added > 0 )
     {
-	PyErr_SetString( PyExc_IndexError, "pop index out of range" );
-	return NULL;
+	pthread_mutex_lock( &it->mutex );
+	it->queued += added;
+	pthread_cond_broadcast( &it->work_cond );
+	pthread_mutex_unlock( &it->mutex );
     }
 
-    result = dict_from_frame( self->frames[index] );
+    return result;
+}
 
-    delete self->frames[index];
-    for ( i = index+1; i < self->size; ++i )
-	self->frames[i-1] = self->frames[i];
-    --self->size;
-
-    return result;
+static void id3_swap_contents( ID3Object* a, ID3Object* b )
+{
+    ID3_Tag* tag = a->tag;
+    ID3_Frame** frames = a->frames;
+    int size = a->size;
+    int alloc = a->alloc;
+    int dirty = a->dirty;
+    unsigned long long* digests = a->digests;
+    stream_info* stream = a->stream;
+    flags_t versions = a->versions;
+    flags_t ondisk = a->ondisk;
+    char* filename = a->filename;
+    unsigned long maxbinary = a->maxbinary;
+    payload_table* deferred = a->deferred;
+
+    a->tag = b->tag;
+    a->frames = b->frames;
+    a->size = b->size;
+    a->alloc = b->alloc;
+    a->dirty = b->dirty;
+    a->digests = b->digests;
+    a->stream = b->stream;
+    a->versions = b->versions;
+    a->ondisk = b->ondisk;
+    a->filename = b->filename;
+    a->maxbinary = b->maxbinary;
+    a->deferred = b->deferred;
+    
+    b->tag = tag;
+    b->frames = frames;
+    b->size = size;
+    b->alloc = alloc;
+    b->dirty = dirty;
+    b->digests = digests;
+    b->stream = stream;
+    b->versions = versions;
+    b->ondisk = ondisk;
+    b->filename = filename;
+    b->maxbinary = maxbinary;
+    b->deferred = deferred;
 }
 
-static PyObject* id3_remove( ID3Object* self, PyObject* args )
+static PyObject* id3_scan( PyObject* self, PyObject* args, PyObject* kwds )
 {
-    int i, index;
-    PyObject* other;
-    PyObject* result;
-
-    if ( !PyArg_ParseTuple( args, "O!", &PyString_Type, &other ) )
-	return NULL;
-    Py_INCREF( other );
-    
-    PyObject* tuple;
-    tuple = PyDict_GetItem( frameid_lookup, other );
-    Py_DECREF( other );
-    if ( tuple == NULL )
-    {
-	PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
-		      PyString_AsString( other ) );
+    static char* kwlist[] = { "filenames", "threads", "readahead", "order", "nocache",
+			      "digests", "streams", "versions", "maxbinary", NULL };
+    PyObject* seq;
+    ID3ScanObject* it;
+    int nthreads = 0;
+    int readahead = 0;
+    char* ordername = NULL;
+    int order = ORDER_NONE;
+    int nocache = 0;
+    int digests = 0;
+    int streams = 0;
+    char* versionname = NULL;
+    flags_t versions;
+    unsigned long maxbinary = 0;
+
+    if ( !PyArg_ParseTupleAndKeywords( args, kwds, "O|iiziiizk:scan", kwlist,
+				       &seq, &nthreads, &readahead, &ordername, &nocache,
+				       &digests, &streams, &versionname, &maxbinary ) )
 	return NULL;
-    }
 
-    ID3_FrameID fid = (ID3_FrameID)PyInt_AsLong( PyTuple_GetItem( tuple, 0 ) );
+    if ( parse_versions( versionname, &versions, "scan" ) < 0 )
+	return NULL;
 
-    index = -1;
-    for ( i = 0; i < self->size; ++i )
-	if ( self->frames[i]->GetID() == fid )
+    if ( ordername != NULL )
+    {
+	if ( strcmp( ordername, "inode" ) == 0 )
+	    order = ORDER_INODE;
+	else if ( strcmp( ordername, "extent" ) == 0 )
+	    order = ORDER_EXTENT;
+	else
 	{
-	    index = i;
-	    break;
+	    PyErr_Format( PyExc_ValueError, "scan() order must be 'inode' or 'extent', not '%s'",
+			  ordername );
+	    return NULL;
 	}
+    }
 
-    if ( index == -1 )
+    if ( nthreads < 0 || nthreads > SCAN_MAX_THREADS )
     {
-	PyErr_SetString( PyExc_ValueError, "frame id not in tag" );
+	PyErr_Format( PyExc_ValueError, "scan() threads must be between 0 and %d",
+		      SCAN_MAX_THREADS );
 	return NULL;
     }
 
-    result = dict_from_frame( self->frames[index] );
+    if ( readahead && nthreads == 0 )
+    {
+	PyErr_SetString( PyExc_ValueError, "scan() readahead requires threads" );
+	return NULL;
+    }
 
-    delete self->frames[index];
-    for ( i = index+1; i < self->size; ++i )
-	self->frames[i-1] = self->frames[i];
-    --self->size;
+    it = PyObject_New( ID3ScanObject, &ID3ScanType );
+    if ( it == NULL )
+	return NULL;
+    it->nthreads = 0;
+    it->load.nocache = nocache;
+    it->load.versions = versions;
+    it->load.maxbinary = maxbinary;
+    it->load.digests = digests;
+    it->streams = streams;
+    it->order = NULL;
+    it->returned = 0;
+    it->busy = 0;
+    if ( order != ORDER_NONE )
+	it->names = NULL;
+    else
+	it->names = PyObject_GetIter( seq );
+    
+    if ( (order != ORDER_NONE && scan_set_order( it, seq, order ) < 0) ||
+	 it->names == NULL )
+    {
+	Py_DECREF( it );
+	return NULL;
+    }
 
-    return result;
-}
+    if ( nthreads > 0 && scan_pool_start( it, nthreads ) < 0 )
+    {
+	scan_pool_stop( it );
+	PyErr_SetString( ID3Error, "unable to start scan threads" );
+	Py_DECREF( it );
+	return NULL;
+    }
+    it->readahead = readahead;
 
+    return (PyObject*)it;
+}
 
+static void id3scan_dealloc( ID3ScanObject* self )
+{
+    if ( self->nthreads > 0 )
+	scan_pool_stop( self );
+    Py_XDECREF( self->names );
+    free( self->order );
+    PyObject_DEL( self );
+}
 
-/////////////////
-//
-//   frames <--> dictionaries
-//
-/////////////////
+static PyObject* id3scan_getiter( PyObject* self )
+{
+    Py_INCREF( self );
+    return self;
+}
 
-static PyObject* dict_from_frame( ID3_Frame* frame )
+static PyObject* id3scan_iternext_threaded( ID3ScanObject* self )
 {
-    ID3_FrameID fid;
-    ID3_FrameInfo finfo;
-    PyObject* result;
-    PyObject* item;
-    
-    fid = frame->GetID();
+    ID3Object* id3obj;
+    scan_job* job;
+    PyObject* name;
+    phase_times times;
+    int failed;
     
-    result = PyDict_New();
+    if ( self->queued - self->delivered <= self->njobs / 2 &&
+	 scan_refill( self ) < 0 )
+	return NULL;
 
-    item = PyString_FromString( finfo.LongName( fid ) );
-    PyDict_SetItem( result, frame_id_key_obj, item );
-    Py_DECREF( item );
-    
-    ID3_Frame::Iterator* fiter = frame->CreateIterator();
-    ID3_Field* field;
-    ID3_TextEnc enc;
-    while( (field = fiter->GetNext()) )
+    if ( self->delivered == self->queued )
+	return NULL;
+
+    if ( self->ready == self->delivered )
     {
-	ID3_FieldID flid = field->GetID();
-	if ( field_keys[flid] == NULL )
-	    continue;
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock( &self->mutex );
 	
-	switch( field->GetType() )
+	while ( self->jobs[self->delivered % self->njobs].state != JOB_DONE )
 	{
-	  case ID3FTY_TEXTSTRING:
-	    enc = field->GetEncoding();
-	    field->SetEncoding( ID3TE_ASCII );
-	    item = PyString_FromString( field->GetRawText() );
-	    field->SetEncoding( ID3TE_ASCII );
-	    break;
-
-	  case ID3FTY_INTEGER:
-	    item = PyInt_FromLong( field->Get() );
-	    break;
-	    
-	  case ID3FTY_BINARY:
-	    int size;
-	    size = field->Size();
-	    item = PyString_FromStringAndSize( (char*)(field->GetRawBinary()), size );
-	    break;
+	    self->waiting = 1;
+	    pthread_cond_wait( &self->done_cond, &self->mutex );
 	}
+	self->waiting = 0;
+
+	// note every job that has finished in sequence after this one,
+	// so the next few calls can skip the lock entirely.
+	self->ready = self->delivered;
+	while ( self->ready < self->taken &&
+		self->jobs[self->ready % self->njobs].state == JOB_DONE )
+	    ++self->ready;
+	
+	pthread_mutex_unlock( &self->mutex );
+	Py_END_ALLOW_THREADS
+    }
 
-	PyDict_SetItem( result, field_keys[flid], item );
-	Py_DECREF( item );
-	    
+    id3obj = id3_alloc();
+    if ( id3obj == NULL )
+	return NULL;
+
+    // finish with the job before running the hook, which is arbitrary
+    // python code; the slot is free for reuse once delivered moves on.
+    job = &self->jobs[self->delivered % self->njobs];
+    id3_swap_contents( id3obj, &job->shell );
+    name = job->name;
+    job->name = NULL;
+    times = job->times;
+    failed = job->failed;
+    ++self->delivered;
+
+    slow_hook_check( PyString_AS_STRING( name ), &times, id3obj );
+    Py_DECREF( name );
+
+    if ( failed )
+    {
+	Py_DECREF( id3obj );
+	return PyErr_NoMemory();
     }
-    delete fiter;
 
+    return (PyObject*)id3obj;
+}
+
+// when the files are visited in on-disk order, each tag comes back
+// paired with its position in the caller's sequence.
+
+static PyObject* id3scan_iternext( ID3ScanObject* self )
+{
+    PyObject* tag;
+    PyObject* result;
+
+    CHECK_NOT_BUSY_SCAN( self, NULL );
+
+    self->busy = 1;
+    tag = id3scan_next_tag( self );
+    if ( tag == NULL || self->order == NULL )
+    {
+	self->busy = 0;
+	return tag;
+    }
+
+    result = Py_BuildValue( "(lN)", self->order[self->returned++], tag );
+    self->busy = 0;
     return result;
 }
 
-static ID3_Frame* frame_from_dict( PyObject* dict )
+static PyObject* id3scan_next_tag( ID3ScanObject* self )
 {
-    PyObject* id = PyDict_GetItemString( dict, "frameid" );
-    if ( id == NULL || !PyString_Check( id ) )
+    PyObject* name;
+    ID3Object* id3obj;
+
+    if ( self->nthreads > 0 )
+	return id3scan_iternext_threaded( self );
+
+    name = PyIter_Next( self->names );
+    if ( name == NULL )
+	return NULL;
+
+    if ( !PyString_Check( name ) )
     {
-	PyErr_SetString( ID3Error, "dictionary must contain 'frameid' with string value" );
+	PyErr_SetString( PyExc_TypeError, "scan() requires a sequence of filenames" );
+	Py_DECREF( name );
 	return NULL;
     }
 
-    PyObject* tuple;
-
-    tuple = PyDict_GetItem( frameid_lookup, id );
-    if ( tuple == NULL )
+    id3obj = id3_alloc();
+    if ( id3obj == NULL )
     {
-	PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
-		      PyString_AsString( id ) );
+	Py_DECREF( name );
 	return NULL;
     }
+    if ( id3_load( id3obj, PyString_AS_STRING( name ), &self->load ) < 0 )
+    {
+	Py_DECREF( name );
+	Py_DECREF( id3obj );
+	return NULL;
+    }
+    Py_DECREF( name );
+
+    if ( self->streams )
+    {
+	Py_BEGIN_ALLOW_THREADS
+	id3_compute_stream( id3obj );
+	Py_END_ALLOW_THREADS
+    }
 
-    ID3_FrameID fid = (ID3_FrameID)PyInt_AsLong( PyTuple_GetItem( tuple, 0 ) );
+    return (PyObject*)id3obj;
+}
 
-    return frame_from_dict( fid, dict );
+/////////////////
+//
+//   frame array storage
+//
+/////////////////
+
+// make room for at least n frame pointers.  the array grows
+// geometrically, so a run of appends costs amortized O(1) calls to
+// the allocator.  returns -1 on failure; no Python exception is set,
+// so this is safe to call without the interpreter lock.
+
+static int id3_reserve( ID3Object* self, int n )
+{
+    int newalloc;
+    ID3_Frame** newframes;
+
+    if ( n <= self->alloc )
+	return 0;
+
+    newalloc = self->alloc < 8 ? 8 : self->alloc;
+    while ( newalloc < n )
+	newalloc *= 2;
+
+    newframes = (ID3_Frame**)realloc( self->frames, newalloc * sizeof( ID3_Frame* ) );
+    if ( newframes == NULL )
+	return -1;
+
+    self->frames = newframes;
+    self->alloc = newalloc;
+    return 0;
 }
 
-    
+// frame arrays of dead tag objects are kept here and handed to the
+// next tag that gets opened, so scanning a batch of files doesn't
+// allocate a fresh array for each one.
 
-static ID3_Frame* frame_from_dict( ID3_FrameID fid, PyObject* dict )
+#define MAX_FREE_FRAME_ARRAYS 16
+
+static ID3_Frame** free_frame_arrays[MAX_FREE_FRAME_ARRAYS];
+static int free_frame_alloc[MAX_FREE_FRAME_ARRAYS];
+static int num_free_frame_arrays = 0;
+
+static void frame_array_get( ID3Object* self )
 {
-    char* data;
-    int size;
-    
-    ID3_Field* field;
-    ID3_FieldID flid;
-    
-    ID3_Frame* frame = new ID3_Frame( fid );
+    if ( num_free_frame_arrays > 0 )
+    {
+	--num_free_frame_arrays;
+	self->frames = free_frame_arrays[num_free_frame_arrays];
+	self->alloc = free_frame_alloc[num_free_frame_arrays];
+    }
+    else
+    {
+	self->frames = NULL;
+	self->alloc = 0;
+    }
+    self->size = 0;
+}
 
-    ID3_Frame::Iterator* fiter = frame->CreateIterator();
-    while( (field = fiter->GetNext()) )
+static void frame_array_put( ID3Object* self )
+{
+    if ( self->frames != NULL && num_free_frame_arrays < MAX_FREE_FRAME_ARRAYS )
     {
-	flid = field->GetID();
-	PyObject* item;
+	free_frame_arrays[num_free_frame_arrays] = self->frames;
+	free_frame_alloc[num_free_frame_arrays] = self->alloc;
+	++num_free_frame_arrays;
+    }
+    else
+	free( self->frames );
 
-	if ( field_keys[flid] == NULL )
-	    continue;
+    self->frames = NULL;
+    self->alloc = self->size = 0;
+}
 
-	item = PyDict_GetItem( dict, field_keys[flid] );
-	if ( item == NULL )
-	    continue;
-	
-	switch( field->GetType() )
-	{
-	  case ID3FTY_TEXTSTRING:
-	    if ( !PyString_Check( item ) )
-	    {
-		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be string", PyString_AsString( field_keys[flid] ) );
-		delete fiter;
-		delete frame;
-		return NULL;
-	    }
-	    field->SetEncoding( ID3TE_ISO8859_1 );
-	    field->Set( PyString_AsString( item ) );
-	    break;
-	    
-	  case ID3FTY_INTEGER:
-	    if ( !PyInt_Check( item ) )
-	    {
-		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be int", PyString_AsString( field_keys[flid] ) );
-		delete fiter;
-		delete frame;
-		return NULL;
-	    }
-	    field->Set( PyInt_AsLong( item ) );
-	    break;
-	    
-	  case ID3FTY_BINARY:
-	    if ( !PyString_Check( item ) )
-	    {
-		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be data string", PyString_AsString( field_keys[flid] ) );
-		delete fiter;
-		delete frame;
-		return NULL;
-	    }
-	    PyString_AsStringAndSize( item, &data, &size );
-	    field->Set( (unsigned char*)data, size );
-	    break;
-	}
-    }
-    delete fiter;
+// likewise the ID3_Tag objects, which id3lib makes fairly costly to
+// build.  a tag going on the list is cleared, which unlinks it from
+// its file.  between them, these lists mean that a loop over scan()
+// keeps recycling the same few tags and arrays, whether or not the
+// caller still holds the tag from the step before.  like the frame
+// arrays, they are only touched with the interpreter lock held.
 
-    return frame;
+#define MAX_FREE_TAGS 16
+
+static ID3_Tag* free_tags[MAX_FREE_TAGS];
+static int num_free_tags = 0;
+
+static ID3_Tag* tag_get( void )
+{
+    if ( num_free_tags > 0 )
+	return free_tags[--num_free_tags];
+
+    return new ID3_Tag;
 }
 
-/////////////////////
+static void tag_put( ID3_Tag* tag )
+{
+    if ( num_free_tags < MAX_FREE_TAGS )
+    {
+	tag->Clear();
+	free_tags[num_free_tags++] = tag;
+    }
+    else
+	delete tag;
+}
+
+/////////////////
 //
-//  accessing frames via "magic attributes"
+//   tp_as_sequence methods
 //
-/////////////////////
+/////////////////
 
-enum frame_type
-{
-    PYFD_Text,
-    PYFD_Tracknum,
-    PYFD_Year,
-    PYFD_URL,
-};
+// building frames from the caller's dictionaries can run Python code
+// (a sequence's __getitem__, a value's __int__), and other threads
+// with it.  one of those may have started reading or writing this
+// tag, or changed its frames, so callers check again once their new
+// frames are built and take any indices only after that.  this frees
+// the new frames if the tag has been taken meanwhile.
 
-typedef struct
+static int busy_after_build( ID3Object* self, ID3_Frame** frames, int n )
 {
-    char* name;
-    ID3_FrameID fid;
-    frame_type type;
-} magic_attribute;
+    int i;
 
-static int magic_attribute_table_size = -1;
+    if ( !self->busy )
+	return 0;
 
-// this list must be sorted by the "name" field.
-static magic_attribute magic_attribute_table[] = {
-    { "album",              ID3FID_ALBUM,                PYFD_Text },
-    { "artist",             ID3FID_LEADARTIST,           PYFD_Text },    // synonym
-    { "band",               ID3FID_BAND,                 PYFD_Text },
-    { "bpm",                ID3FID_BPM,                  PYFD_Text },
-    { "composer",           ID3FID_COMPOSER,             PYFD_Text },
+    for ( i = 0; i < n; ++i )
+	delete frames[i];
+    PyErr_SetString( ID3Error, "tag is busy in another thread" );
+    return -1;
+}
+
+static int id3_length( ID3Object* self )
+{
+    CHECK_NOT_BUSY( self, -1 );
+
+    return self->size;
+}
+
+static PyObject* id3_item( ID3Object* self, int index )
+{
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( index < 0 )
+	index += self->size;
+
+    if ( index < 0 || index >= self->size )
+    {
+	PyErr_SetString( PyExc_IndexError, "frame index out of range" );
+	return NULL;
+    }
+
+    return dict_from_frame( self, self->frames[index] );
+}
+
+static PyObject* id3_slice( ID3Object* self, int start, int end )
+{
+    PyObject* result;
+    int i;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( start < 0 )
+	start = 0;
+    else if ( start > self->size )
+	start = self->size;
+
+    if ( end < start )
+	end = start;
+    else if ( end > self->size )
+	end = self->size;
+
+    result = PyList_New( end-start );
+    if ( result == NULL )
+	return NULL;
+
+    for ( i = start; i < end; ++i )
+    {
+	PyObject* v = dict_from_frame( self, self->frames[i] );
+	if ( v == NULL )
+	{
+	    Py_DECREF( result );
+	    return NULL;
+	}
+	PyList_SetItem( result, i-start, v );
+    }
+
+    return result;
+}
+
+
+static int id3_ass_item( ID3Object* self, int index, PyObject* dict )
+{
+    ID3_Frame* newframe;
+
+    CHECK_NOT_BUSY( self, -1 );
+
+    if ( index < 0 )
+	index += self->size;
+    if ( index < 0 || index >= self->size )
+    {
+	PyErr_SetString( PyExc_IndexError, "frame assignment index out of range" );
+	return -1;
+    }
+
+    if ( dict == NULL )
+    {
+	// deleting a frame
+	
+	int i;
+	
+	frame_drop( self, self->frames[index] );
+
+	for ( i = index+1; i < self->size; ++i )
+	    self->frames[i-1] = self->frames[i];
+	--self->size;
+	self->dirty = 1;
+
+	return 0;
+    }
+    
+    if ( !PyDict_Check( dict ) )
+    {
+	PyErr_SetString( ID3Error, "frame assignment must be from dictionary" );
+	return -1;
+    }
+    
+    newframe = frame_from_dict( dict );
+    if ( newframe == NULL || busy_after_build( self, &newframe, 1 ) < 0 )
+	return -1;
+    if ( index >= self->size )
+    {
+	delete newframe;
+	PyErr_SetString( PyExc_IndexError, "frame assignment index out of range" );
+	return -1;
+    }
+
+    // if the old frame's payload can't be read back to compare, just
+    // replace it.
+    if ( frames_equal( self, self->frames[index], NULL, newframe ) > 0 )
+    {
+	delete newframe;
+	return 0;
+    }
+
+    frame_drop( self, self->frames[index] );
+    self->frames[index] = newframe;
+    self->dirty = 1;
+
+    return 0;
+}
+
+static ID3_Frame** frames_from_dictseq( PyObject* dictseq, int *count )
+{
+    ID3_Frame** newframes;
+    PyObject* dict;
+    int i, n;
+    
+    if ( !PySequence_Check( dictseq ) )
+    {
+	PyErr_SetString( ID3Error, "slice assignment must be from sequence of dictionaries" );
+	*count = -1;
+	return NULL;
+    }
+
+    n = PySequence_Size( dictseq );
+    if ( n == 0 )
+    {
+	*count = 0;
+	return NULL;
+    }
+    
+    newframes = new ID3_Frame* [n];
+    for ( i = 0; i < n; ++i )
+	newframes[i] = NULL;
+	
+    for ( i = 0; i < n; ++i )
+    {
+	dict = PySequence_GetItem( dictseq, i );
+	if ( !PyDict_Check( dict ) )
+	{
+	    PyErr_SetString( ID3Error, "slice assignment must be from sequence of dictionaries" );
+	    Py_DECREF( dict );
+	    goto abort;
+	}
+
+	newframes[i] = frame_from_dict( dict );
+	Py_DECREF( dict );
+	if ( newframes[i] == NULL )
+	    goto abort;
+    }
+
+    *count = n;
+    return newframes;
+    
+    
+    abort:
+    
+    for( i = 0; i < n; ++i )
+	if ( newframes[i] )
+	    delete newframes[i];
+    delete [] newframes;
+
+    *count = -1;
+    return NULL;
+}
+
+static int id3_ass_slice( ID3Object* self, int start, int end, PyObject* dictseq )
+{
+    int i, n = 0;
+    int newsize;
+    ID3_Frame** newframes = NULL;
+
+    CHECK_NOT_BUSY( self, -1 );
+
+    // first, try to create frames from dictseq
+
+    if ( dictseq != NULL )
+    {
+	newframes = frames_from_dictseq( dictseq, &n );
+	if ( newframes == NULL && n != 0 )
+	    return -1;           // some error occurred in reading dictseq
+	if ( busy_after_build( self, newframes, n ) < 0 )
+	{
+	    delete [] newframes;
+	    return -1;
+	}
+    }
+	
+    if ( start < 0 )
+	start = 0;
+    else if ( start > self->size )
+	start = self->size;
+
+    if ( end < start )
+	end = start;
+    else if ( end > self->size )
+	end = self->size;
+
+    if ( newframes == NULL )
+    {
+	// deleting, or assigning an empty sequence
+	for ( i = start; i < end; ++i )
+	    frame_drop( self, self->frames[i] );
+
+	for ( i = end; i < self->size; ++i )
+	    self->frames[i-end+start] = self->frames[i];
+	self->size -= (end-start);
+	if ( end > start )
+	    self->dirty = 1;
+
+	return 0;
+    }
+    
+    // assigning a slice the frames it already holds changes nothing;
+    // keep the old frames and leave the tag clean.  frames that can't
+    // be compared count as changed.
+
+    if ( n == end - start )
+    {
+	for ( i = 0; i < n && frames_equal( self, self->frames[start + i], NULL, newframes[i] ) > 0; ++i )
+	    ;
+	if ( i == n )
+	{
+	    for ( i = 0; i < n; ++i )
+		delete newframes[i];
+	    delete [] newframes;
+	    return 0;
+	}
+    }
+
+    // hooray, no problems with the caller's value.  start shifting
+    // around existing frames to insert the new ones.
+    
+    newsize = self->size - (end-start) + n;
+
+    if ( id3_reserve( self, newsize ) < 0 )
+    {
+	PyErr_NoMemory();
+	for ( i = 0; i < n; ++i )
+	    delete newframes[i];
+	delete [] newframes;
+	return -1;
+    }
+
+    for ( i = start; i < end; ++i )
+	frame_drop( self, self->frames[i] );
+
+    if ( newsize >= self->size )
+    {
+	// shift frames after "end" to the right
+	for ( i = self->size-1; i >= end; --i )
+	    self->frames[i + n - end + start] = self->frames[i];
+    }
+    else
+    {
+	// shift frames after "end" to the left
+	for ( i = end; i < self->size; ++i )
+	    self->frames[i + n - end + start] = self->frames[i];
+    }
+    for ( i = 0; i < n; ++i )
+	self->frames[start + i] = newframes[i];
+    delete [] newframes;
+    self->size = newsize;
+    self->dirty = 1;
+
+    return 0;
+}
+
+/////////////////
+//
+//   explicit mutable sequence methods
+//
+/////////////////
+
+static int id3_contains( ID3Object* self, PyObject* other )
+{
+    int i;
+    ID3_FrameID fid;
+    
+    if ( !PyString_Check( other ) && !PyInt_Check( other ) )
+    {
+	PyErr_SetString( ID3Error, "'in <tag>' requires string or int as left operand" );
+	return -1;
+    }
+
+    CHECK_NOT_BUSY( self, -1 );
+
+    if ( frameid_from_object( other, &fid ) < 0 )
+	return -1;
+
+    for ( i = 0; i < self->size; ++i )
+	if ( self->frames[i]->GetID() == fid )
+	    return 1;
+
+    return 0;
+}
+
+static PyObject* id3_append( ID3Object* self, PyObject* dict )
+{
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( !PyDict_Check( dict ) )
+    {
+	PyErr_SetString( ID3Error, "frame append must be from dictionary" );
+	return NULL;
+    }
+    
+    ID3_Frame* newframe = frame_from_dict( dict );
+    if ( newframe == NULL || busy_after_build( self, &newframe, 1 ) < 0 )
+	return NULL;
+
+    if ( id3_reserve( self, self->size + 1 ) < 0 )
+    {
+	PyErr_NoMemory();
+	delete newframe;
+	return NULL;
+    }
+
+    self->frames[self->size++] = newframe;
+    self->dirty = 1;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+static PyObject* id3_extend( ID3Object* self, PyObject* dictseq )
+{
+    int i, n;
+    ID3_Frame** newframes;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    newframes = frames_from_dictseq( dictseq, &n );
+
+    if ( newframes == NULL )
+    {
+	if ( n == 0 )
+	    goto done;    // sequence was empty
+	else
+	    return NULL;  // error processing dictseq
+    }
+    if ( busy_after_build( self, newframes, n ) < 0 )
+    {
+	delete [] newframes;
+	return NULL;
+    }
+
+    if ( id3_reserve( self, self->size + n ) < 0 )
+    {
+	PyErr_NoMemory();
+	for ( i = 0; i < n; ++i )
+	    delete newframes[i];
+	delete [] newframes;
+	return NULL;
+    }
+
+    for ( i = 0; i < n; ++i )
+	self->frames[self->size + i] = newframes[i];
+    self->size += n;
+    self->dirty = 1;
+    delete [] newframes;
+
+ done:
+    Py_INCREF( Py_None );
+    return Py_None;
+    
+}
+
+static PyObject* id3_count( ID3Object* self, PyObject* other )
+{
+    int i, c;
+    ID3_FrameID fid;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( frameid_from_object( other, &fid ) < 0 )
+	return NULL;
+
+    c = 0;
+    for ( i = 0; i < self->size; ++i )
+	if ( self->frames[i]->GetID() == fid )
+	    ++c;
+
+    return PyInt_FromLong( c );
+}
+
+static PyObject* id3_index( ID3Object* self, PyObject* other )
+{
+    int i;
+    ID3_FrameID fid;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( frameid_from_object( other, &fid ) < 0 )
+	return NULL;
+
+    for ( i = 0; i < self->size; ++i )
+	if ( self->frames[i]->GetID() == fid )
+	    return PyInt_FromLong( i );
+
+    PyErr_SetString( PyExc_ValueError, "frame id not in tag" );
+    return NULL;
+}
+
+static PyObject* id3_insert( ID3Object* self, PyObject* args )
+{
+    PyObject* dict;
+    int i, index;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( !PyArg_ParseTuple( args, "iO", &index, &dict ) )
+	return NULL;
+    Py_INCREF( dict );
+
+    if ( !PyDict_Check( dict ) )
+    {
+	PyErr_SetString( ID3Error, "frame insert must be from dictionary" );
+	Py_DECREF( dict );
+	return NULL;
+    }
+
+    ID3_Frame* newframe = frame_from_dict( dict );
+    Py_DECREF( dict );
+    if ( newframe == NULL || busy_after_build( self, &newframe, 1 ) < 0 )
+	return NULL;
+
+    if ( id3_reserve( self, self->size + 1 ) < 0 )
+    {
+	PyErr_NoMemory();
+	delete newframe;
+	return NULL;
+    }
+
+    if ( index < 0 )
+	index = 0;
+    else if ( index > self->size )
+	index = self->size;
+    
+    for ( i = self->size-1; i >= index; --i )
+	self->frames[i+1] = self->frames[i];
+    self->frames[index] = newframe;
+    ++self->size;
+    self->dirty = 1;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+static PyObject* id3_pop( ID3Object* self, PyObject* args )
+{
+    int index = self->size-1;
+    int i;
+    PyObject* result;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( !PyArg_ParseTuple( args, "|i", &index ) )
+	return NULL;
+
+    if ( self->size == 0 )
+    {
+	PyErr_SetString( PyExc_IndexError, "pop from empty tag" );
+	return NULL;
+    }
+    
+    if ( index < 0 || index >= self->size )
+    {
+	PyErr_SetString( PyExc_IndexError, "pop index out of range" );
+	return NULL;
+    }
+
+    result = dict_from_frame( self, self->frames[index] );
+    if ( result == NULL )
+	return NULL;
+
+    frame_drop( self, self->frames[index] );
+    for ( i = index+1; i < self->size; ++i )
+	self->frames[i-1] = self->frames[i];
+    --self->size;
+    self->dirty = 1;
+
+    return result;
+}
+
+static PyObject* id3_remove( ID3Object* self, PyObject* other )
+{
+    int i, index;
+    PyObject* result;
+    ID3_FrameID fid;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( frameid_from_object( other, &fid ) < 0 )
+	return NULL;
+
+    index = -1;
+    for ( i = 0; i < self->size; ++i )
+	if ( self->frames[i]->GetID() == fid )
+	{
+	    index = i;
+	    break;
+	}
+
+    if ( index == -1 )
+    {
+	PyErr_SetString( PyExc_ValueError, "frame id not in tag" );
+	return NULL;
+    }
+
+    result = dict_from_frame( self, self->frames[index] );
+    if ( result == NULL )
+	return NULL;
+
+    frame_drop( self, self->frames[index] );
+    for ( i = index+1; i < self->size; ++i )
+	self->frames[i-1] = self->frames[i];
+    --self->size;
+    self->dirty = 1;
+
+    return result;
+}
+
+
+
+/////////////////
+//
+//   frame IDs
+//
+/////////////////
+
+// every frame ID id3lib supports, keyed by its four characters packed
+// into an integer.  this list is sorted by "code" when the module is
+// initialized, so it can be searched with bsearch.
+
+typedef struct
+{
+    unsigned long code;
+    ID3_FrameID fid;
+} frameid_code;
+
+#define FOURCC(s)  ( ((unsigned long)(unsigned char)(s)[0] << 24) | \
+                     ((unsigned long)(unsigned char)(s)[1] << 16) | \
+                     ((unsigned long)(unsigned char)(s)[2] << 8) | \
+                     ((unsigned long)(unsigned char)(s)[3]) )
+
+static frameid_code frameid_code_table[ID3FID_LASTFRAMEID];
+static int frameid_code_table_size = 0;
+static char frameid_supported[ID3FID_LASTFRAMEID];
+
+static int frameid_code_compare( const void* a, const void* b )
+{
+    unsigned long x = ((frameid_code*)a)->code;
+    unsigned long y = ((frameid_code*)b)->code;
+
+    return x < y ? -1 : x > y;
+}
+
+// a frame ID may be given either as its four-character string or as
+// the corresponding integer constant exported by the module.
+
+static int frameid_from_object( PyObject* obj, ID3_FrameID* fid )
+{
+    if ( PyInt_Check( obj ) )
+    {
+	long i = PyInt_AS_LONG( obj );
+	
+	if ( i <= ID3FID_NOFRAME || i >= ID3FID_LASTFRAMEID || !frameid_supported[i] )
+	{
+	    PyErr_Format( ID3Error, "frame id %ld not supported by id3lib", i );
+	    return -1;
+	}
+	*fid = (ID3_FrameID)i;
+	return 0;
+    }
+
+    if ( PyString_Check( obj ) )
+    {
+	frameid_code key;
+	frameid_code* p = NULL;
+
+	if ( PyString_GET_SIZE( obj ) == 4 )
+	{
+	    key.code = FOURCC( PyString_AS_STRING( obj ) );
+	    p = (frameid_code*)bsearch( &key,
+					frameid_code_table,
+					frameid_code_table_size,
+					sizeof( frameid_code ),
+					frameid_code_compare );
+	}
+	if ( p == NULL )
+	{
+	    PyErr_Format( ID3Error, "frame id '%s' not supported by id3lib",
+			  PyString_AS_STRING( obj ) );
+	    return -1;
+	}
+	*fid = p->fid;
+	return 0;
+    }
+
+    PyErr_SetString( ID3Error, "frame id must be string or int" );
+    return -1;
+}
+
+/////////////////
+//
+//   frames <--> dictionaries
+//
+/////////////////
+
+static PyObject* dict_from_frame( ID3Object* owner, ID3_Frame* frame )
+{
+    ID3_FrameID fid;
+    ID3_FrameInfo finfo;
+    PyObject* result;
+    PyObject* item;
+    const deferred_payload* ref;
+    
+    fid = frame->GetID();
+    
+    result = PyDict_New();
+
+    item = PyString_FromString( finfo.LongName( fid ) );
+    PyDict_SetItem( result, frame_id_key_obj, item );
+    Py_DECREF( item );
+    
+    ID3_Frame::Iterator* fiter = frame->CreateIterator();
+    ID3_Field* field;
+    ID3_TextEnc enc;
+    while( (field = fiter->GetNext()) )
+    {
+	ID3_FieldID flid = field->GetID();
+	if ( field_keys[flid] == NULL )
+	    continue;
+	
+	switch( field->GetType() )
+	{
+	  case ID3FTY_TEXTSTRING:
+	    enc = field->GetEncoding();
+	    field->SetEncoding( ID3TE_ASCII );
+	    item = PyString_FromString( field->GetRawText() );
+	    field->SetEncoding( ID3TE_ASCII );
+	    break;
+
+	  case ID3FTY_INTEGER:
+	    item = PyInt_FromLong( field->Get() );
+	    break;
+	    
+	  case ID3FTY_BINARY:
+	    size_t size;
+	    if ( (ref = payload_find( owner, field )) != NULL )
+	    {
+		size = ref->length;
+		item = PyString_FromStringAndSize( NULL, size );
+		if ( item != NULL && payload_read( owner, ref, PyString_AS_STRING( item ) ) < 0 )
+		{
+		    Py_DECREF( item );
+		    item = PyErr_SetFromErrnoWithFilename( PyExc_IOError,
+							   (char*)id3_filename( owner ) );
+		}
+	    }
+	    else
+	    {
+		size = field->Size();
+		item = PyString_FromStringAndSize( (char*)(field->GetRawBinary()), size );
+	    }
+	    STAT_ADD( STAT_BINARY_BYTES, size );
+	    break;
+	}
+
+	if ( item == NULL )
+	{
+	    delete fiter;
+	    Py_DECREF( result );
+	    return NULL;
+	}
+	PyDict_SetItem( result, field_keys[flid], item );
+	Py_DECREF( item );
+	    
+    }
+    delete fiter;
+
+    STAT_ADD( STAT_DICTS_BUILT, 1 );
+
+    return result;
+}
+
+static ID3_Frame* frame_from_dict( PyObject* dict )
+{
+    ID3_FrameID fid;
+    PyObject* id = PyDict_GetItem( dict, frame_id_key_obj );
+    if ( id == NULL || (!PyString_Check( id ) && !PyInt_Check( id )) )
+    {
+	PyErr_SetString( ID3Error, "dictionary must contain 'frameid' with string or int value" );
+	return NULL;
+    }
+
+    if ( frameid_from_object( id, &fid ) < 0 )
+	return NULL;
+
+    return frame_from_dict( fid, dict );
+}
+
+    
+
+static ID3_Frame* frame_from_dict( ID3_FrameID fid, PyObject* dict )
+{
+    char* data;
+    int size;
+    
+    ID3_Field* field;
+    ID3_FieldID flid;
+    
+    ID3_Frame* frame = new ID3_Frame( fid );
+
+    ID3_Frame::Iterator* fiter = frame->CreateIterator();
+    while( (field = fiter->GetNext()) )
+    {
+	flid = field->GetID();
+	PyObject* item;
+
+	if ( field_keys[flid] == NULL )
+	    continue;
+
+	item = PyDict_GetItem( dict, field_keys[flid] );
+	if ( item == NULL )
+	    continue;
+	
+	switch( field->GetType() )
+	{
+	  case ID3FTY_TEXTSTRING:
+	    if ( !PyString_Check( item ) )
+	    {
+		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be string", PyString_AsString( field_keys[flid] ) );
+		delete fiter;
+		delete frame;
+		return NULL;
+	    }
+	    field->SetEncoding( ID3TE_ISO8859_1 );
+	    field->Set( PyString_AsString( item ) );
+	    break;
+	    
+	  case ID3FTY_INTEGER:
+	    if ( !PyInt_Check( item ) )
+	    {
+		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be int", PyString_AsString( field_keys[flid] ) );
+		delete fiter;
+		delete frame;
+		return NULL;
+	    }
+	    field->Set( PyInt_AsLong( item ) );
+	    break;
+	    
+	  case ID3FTY_BINARY:
+	    if ( !PyString_Check( item ) )
+	    {
+		PyErr_Format( ID3Error, "bad dictionary: '%s' value must be data string", PyString_AsString( field_keys[flid] ) );
+		delete fiter;
+		delete frame;
+		return NULL;
+	    }
+	    PyString_AsStringAndSize( item, &data, &size );
+	    field->Set( (unsigned char*)data, size );
+	    STAT_ADD( STAT_BINARY_BYTES, size );
+	    break;
+	}
+    }
+    delete fiter;
+
+    return frame;
+}
+
+/////////////////////
+//
+//  comparing and patching tags
+//
+/////////////////////
+
+// the contents of a text or binary field of owner's as raw bytes, in
+// whatever encoding the field is using.  owner may be NULL for a frame
+// that belongs to no tag.  a payload that was left in the file is read
+// into *buf, which has to be freed afterwards; returns -1 with errno
+// set if it can't be.
+
+static int field_raw( ID3Object* owner, ID3_Field* field, const void** data, size_t* len,
+		      void** buf )
+{
+    const deferred_payload* ref;
+    
+    *buf = NULL;
+    *len = field->BinSize();
+    if ( field->GetType() == ID3FTY_BINARY )
+    {
+	if ( (ref = payload_find( owner, field )) == NULL )
+	    *data = field->GetRawBinary();
+	else if ( (*buf = payload_fetch( owner, ref )) == NULL )
+	    return -1;
+	else
+	{
+	    *len = ref->length;
+	    *data = *buf;
+	}
+    }
+    else if ( field->GetEncoding() == ID3TE_ISO8859_1 )
+	*data = field->GetRawText();
+    else
+	*data = field->GetRawUnicodeText();
+
+    return 0;
+}
+
+// 1 if the fields hold the same thing, 0 if not, or -1 with errno set
+// if a payload couldn't be read from the file to tell.
+
+static int fields_equal( ID3Object* oa, ID3_Field* a, ID3Object* ob, ID3_Field* b )
+{
+    const void* da;
+    const void* db;
+    size_t na, nb;
+    void* ba;
+    void* bb;
+    int equal;
+
+    if ( a->GetID() != b->GetID() || a->GetType() != b->GetType() )
+	return 0;
+    
+    if ( a->GetType() == ID3FTY_INTEGER )
+	return a->Get() == b->Get();
+    
+    if ( a->GetType() == ID3FTY_TEXTSTRING && a->GetEncoding() != b->GetEncoding() )
+	return 0;
+
+    // payloads of different sizes differ; no need to read them in.
+    if ( a->GetType() == ID3FTY_BINARY && binary_size( oa, a ) != binary_size( ob, b ) )
+	return 0;
+
+    if ( field_raw( oa, a, &da, &na, &ba ) < 0 )
+	return -1;
+    if ( field_raw( ob, b, &db, &nb, &bb ) < 0 )
+    {
+	free( ba );
+	return -1;
+    }
+    if ( na != nb )
+	equal = 0;
+    else if ( na == 0 || da == NULL || db == NULL )
+	equal = da == db || na == 0;
+    else
+	equal = memcmp( da, db, na ) == 0;
+    free( ba );
+    free( bb );
+
+    return equal;
+}
+
+static int frames_equal( ID3Object* oa, ID3_Frame* a, ID3Object* ob, ID3_Frame* b )
+{
+    ID3_Field* fa;
+    ID3_Field* fb;
+    int equal = 1;
+    
+    if ( a->GetID() != b->GetID() || a->NumFields() != b->NumFields() )
+	return 0;
+
+    ID3_Frame::Iterator* ia = a->CreateIterator();
+    ID3_Frame::Iterator* ib = b->CreateIterator();
+    while ( equal > 0 && (fa = ia->GetNext()) && (fb = ib->GetNext()) )
+	equal = fields_equal( oa, fa, ob, fb );
+    delete ia;
+    delete ib;
+
+    return equal;
+}
+
+static PyObject* diff_op( const char* op, int index, ID3Object* owner, ID3_Frame* frame )
+{
+    PyObject* dict;
+    
+    dict = dict_from_frame( owner, frame );
+    if ( dict == NULL )
+	return NULL;
+
+    if ( index < 0 )
+	return Py_BuildValue( "(sN)", op, dict );
+    return Py_BuildValue( "(siN)", op, index, dict );
+}
+
+// what it takes to turn this tag's frames into the other ones, as a
+// list of ("change", index, dict), ("remove", index) and ("add", dict)
+// tuples, in that order of preference.  frames are first paired off
+// with identical frames on the other side, so reordering alone is not
+// a difference.  any frames left over are paired with the first
+// unpaired frame of the same ID on the other side (a "change"), and
+// whatever remains after that is added or removed.
+
+static PyObject* id3_diff( ID3Object* self, PyObject* other )
+{
+    ID3_Frame** theirs;
+    ID3Object* otag = NULL;
+    PyObject* result = NULL;
+    PyObject* op;
+    int* pair;              // for each of our frames, the index of its partner or -1
+    char* taken;            // for each of theirs, whether it has a partner
+    int n, i, j, pass, equal;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( PyObject_TypeCheck( other, &ID3Type ) )
+    {
+	otag = (ID3Object*)other;
+	CHECK_NOT_BUSY( otag, NULL );
+	theirs = otag->frames;
+	n = otag->size;
+    }
+    else
+    {
+	// check the shape here, so the error names diff() rather than
+	// the slice assignment frames_from_dictseq() was written for.
+	if ( !PySequence_Check( other ) || PyString_Check( other ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "diff() requires a tag or a sequence of dictionaries" );
+	    return NULL;
+	}
+	n = PySequence_Size( other );
+	for ( i = 0; i < n; ++i )
+	{
+	    op = PySequence_GetItem( other, i );
+	    if ( op == NULL )
+		return NULL;
+	    j = PyDict_Check( op );
+	    Py_DECREF( op );
+	    if ( !j )
+	    {
+		PyErr_SetString( PyExc_TypeError, "diff() requires a tag or a sequence of dictionaries" );
+		return NULL;
+	    }
+	}
+	
+	theirs = frames_from_dictseq( other, &n );
+	if ( theirs == NULL && n != 0 )
+	    return NULL;
+	if ( busy_after_build( self, theirs, n ) < 0 )
+	{
+	    delete [] theirs;
+	    return NULL;
+	}
+    }
+
+    pair = new int [self->size + 1];
+    taken = new char [n + 1];
+    for ( i = 0; i < self->size; ++i )
+	pair[i] = -1;
+    memset( taken, 0, n );
+
+    for ( pass = 0; pass < 2; ++pass )
+	for ( j = 0; j < n; ++j )
+	{
+	    if ( taken[j] )
+		continue;
+	    for ( i = 0; i < self->size; ++i )
+	    {
+		if ( pair[i] >= 0 || self->frames[i]->GetID() != theirs[j]->GetID() )
+		    continue;
+		equal = pass == 1 ? 1 : frames_equal( self, self->frames[i], otag, theirs[j] );
+		if ( equal < 0 )
+		    goto failed;
+		if ( equal )
+		{
+		    pair[i] = j;
+		    taken[j] = 1;
+		    break;
+		}
+	    }
+	}
+
+    result = PyList_New( 0 );
+    if ( result == NULL )
+	goto done;
+
+    for ( i = 0; i < self->size; ++i )
+    {
+	if ( pair[i] < 0 )
+	    op = Py_BuildValue( "(si)", "remove", i );
+	else if ( (equal = frames_equal( self, self->frames[i], otag, theirs[pair[i]] )) < 0 )
+	    goto failed;
+	else if ( !equal )
+	    op = diff_op( "change", i, otag, theirs[pair[i]] );
+	else
+	    continue;
+
+	if ( op == NULL || PyList_Append( result, op ) < 0 )
+	{
+	    Py_XDECREF( op );
+	    Py_CLEAR( result );
+	    goto done;
+	}
+	Py_DECREF( op );
+    }
+
+    for ( j = 0; j < n; ++j )
+    {
+	if ( taken[j] )
+	    continue;
+
+	op = diff_op( "add", -1, otag, theirs[j] );
+	if ( op == NULL || PyList_Append( result, op ) < 0 )
+	{
+	    Py_XDECREF( op );
+	    Py_CLEAR( result );
+	    goto done;
+	}
+	Py_DECREF( op );
+    }
+    goto done;
+
+    // a payload left in one of the files couldn't be read back.
+ failed:
+    PyErr_SetFromErrno( PyExc_IOError );
+    Py_CLEAR( result );
+ done:
+    delete [] pair;
+    delete [] taken;
+    if ( otag == NULL )
+    {
+	for ( j = 0; j < n; ++j )
+	    delete theirs[j];
+	delete [] theirs;
+    }
+
+    return result;
+}
+
+// apply a list of operations as returned by diff().  the indices
+// refer to the frames as they were when the diff was made; only the
+// frames named are rebuilt.  everything is checked before anything is
+// changed, so on error the tag is left as it was.
+
+static PyObject* id3_patch( ID3Object* self, PyObject* ops )
+{
+    PyObject* seq;
+    PyObject* item;
+    ID3_Frame** replace = NULL;
+    ID3_Frame** added = NULL;
+    char* drop = NULL;
+    const char* name;
+    int nops, nadded = 0;
+    int i, j, index, size;
+    PyObject* dict;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    seq = PySequence_Fast( ops, "patch() argument must be a sequence of operations" );
+    if ( seq == NULL )
+	return NULL;
+    nops = PySequence_Fast_GET_SIZE( seq );
+
+    // the new frames are built from the caller's dictionaries, which
+    // can let other threads in (see busy_after_build()), so everything
+    // up to applying the operations goes by the size the tag had here.
+    size = self->size;
+    replace = new ID3_Frame* [size + 1];
+    drop = new char [size + 1];
+    added = new ID3_Frame* [nops + 1];
+    for ( i = 0; i < size; ++i )
+    {
+	replace[i] = NULL;
+	drop[i] = 0;
+    }
+
+    for ( i = 0; i < nops; ++i )
+    {
+	item = PySequence_Fast_GET_ITEM( seq, i );
+	index = -1;
+	dict = NULL;
+	
+	if ( !PyTuple_Check( item ) || PyTuple_GET_SIZE( item ) < 2 ||
+	     !PyString_Check( PyTuple_GET_ITEM( item, 0 ) ) )
+	    goto badop;
+	name = PyString_AS_STRING( PyTuple_GET_ITEM( item, 0 ) );
+
+	if ( strcmp( name, "add" ) == 0 && PyTuple_GET_SIZE( item ) == 2 )
+	    dict = PyTuple_GET_ITEM( item, 1 );
+	else if ( strcmp( name, "remove" ) == 0 && PyTuple_GET_SIZE( item ) == 2 &&
+		  PyInt_Check( PyTuple_GET_ITEM( item, 1 ) ) )
+	    index = PyInt_AsLong( PyTuple_GET_ITEM( item, 1 ) );
+	else if ( strcmp( name, "change" ) == 0 && PyTuple_GET_SIZE( item ) == 3 &&
+		  PyInt_Check( PyTuple_GET_ITEM( item, 1 ) ) )
+	{
+	    index = PyInt_AsLong( PyTuple_GET_ITEM( item, 1 ) );
+	    dict = PyTuple_GET_ITEM( item, 2 );
+	}
+	else
+	    goto badop;
+
+	if ( dict != NULL && !PyDict_Check( dict ) )
+	    goto badop;
+	
+	if ( index != -1 || name[0] != 'a' )
+	{
+	    if ( index < 0 || index >= size )
+	    {
+		PyErr_SetString( PyExc_IndexError, "patch() frame index out of range" );
+		goto abort;
+	    }
+	    if ( drop[index] || replace[index] )
+	    {
+		PyErr_Format( PyExc_ValueError, "patch() has more than one operation for frame %d", index );
+		goto abort;
+	    }
+	}
+
+	if ( dict == NULL )
+	{
+	    drop[index] = 1;
+	    continue;
+	}
+
+	ID3_Frame* frame = frame_from_dict( dict );
+	if ( frame == NULL )
+	    goto abort;
+	if ( index >= 0 )
+	    replace[index] = frame;
+	else
+	    added[nadded++] = frame;
+    }
+
+    if ( self->busy )
+    {
+	PyErr_SetString( ID3Error, "tag is busy in another thread" );
+	goto abort;
+    }
+    if ( self->size != size )
+    {
+	PyErr_SetString( ID3Error, "tag changed while patch() was running" );
+	goto abort;
+    }
+
+    if ( id3_reserve( self, self->size + nadded ) < 0 )
+    {
+	PyErr_NoMemory();
+	goto abort;
+    }
+
+    j = 0;
+    for ( i = 0; i < self->size; ++i )
+    {
+	if ( drop[i] )
+	    frame_drop( self, self->frames[i] );
+	else if ( replace[i] )
+	{
+	    frame_drop( self, self->frames[i] );
+	    self->frames[j++] = replace[i];
+	}
+	else
+	    self->frames[j++] = self->frames[i];
+    }
+    for ( i = 0; i < nadded; ++i )
+	self->frames[j++] = added[i];
+    self->size = j;
+    if ( nops > 0 )
+	self->dirty = 1;
+
+    delete [] replace;
+    delete [] drop;
+    delete [] added;
+    Py_DECREF( seq );
+
+    Py_INCREF( Py_None );
+    return Py_None;
+
+
+ badop:
+    PyErr_Format( ID3Error, "bad patch operation at position %d", i );
+ abort:
+    for ( i = 0; i < size; ++i )
+	delete replace[i];
+    for ( i = 0; i < nadded; ++i )
+	delete added[i];
+    delete [] replace;
+    delete [] drop;
+    delete [] added;
+    Py_DECREF( seq );
+
+    return NULL;
+}
+
+/////////////////////
+//
+//  digests
+//
+/////////////////////
+
+// 64-bit content digests, using the XXH64 algorithm.  this is the
+// portable scalar version; it runs at several GB/s, which is well
+// ahead of anything the disk can deliver.
+
+#define XXH_PRIME64_1  11400714785074694791ULL
+#define XXH_PRIME64_2  14029467366897019727ULL
+#define XXH_PRIME64_3   1609587929392839161ULL
+#define XXH_PRIME64_4   9650029242287828579ULL
+#define XXH_PRIME64_5   2870177450012600261ULL
+
+#define XXH_ROTL64( x, r )  (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long xxh_read64( const unsigned char* p )
+{
+    return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+	((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+	((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+	((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+static unsigned long long xxh_read32( const unsigned char* p )
+{
+    return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+	((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+}
+
+static unsigned long long xxh_round( unsigned long long acc, unsigned long long input )
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64( acc, 31 );
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh_merge( unsigned long long acc, unsigned long long val )
+{
+    acc ^= xxh_round( 0, val );
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// the last stage of the digest: whatever was left over after the
+// 32-byte stripes, then the final mixing.
+
+static unsigned long long xxh_finish( unsigned long long h, const unsigned char* p,
+				      const unsigned char* end )
+{
+    for ( ; p + 8 <= end; p += 8 )
+    {
+	h ^= xxh_round( 0, xxh_read64( p ) );
+	h = XXH_ROTL64( h, 27 ) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if ( p + 4 <= end )
+    {
+	h ^= xxh_read32( p ) * XXH_PRIME64_1;
+	h = XXH_ROTL64( h, 23 ) * XXH_PRIME64_2 + XXH_PRIME64_3;
+	p += 4;
+    }
+    for ( ; p < end; ++p )
+    {
+	h ^= *p * XXH_PRIME64_5;
+	h = XXH_ROTL64( h, 11 ) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static unsigned long long xxh_converge( unsigned long long v1, unsigned long long v2,
+					unsigned long long v3, unsigned long long v4 )
+{
+    unsigned long long h;
+
+    h = XXH_ROTL64( v1, 1 ) + XXH_ROTL64( v2, 7 ) + XXH_ROTL64( v3, 12 ) + XXH_ROTL64( v4, 18 );
+    h = xxh_merge( h, v1 );
+    h = xxh_merge( h, v2 );
+    h = xxh_merge( h, v3 );
+    return xxh_merge( h, v4 );
+}
+
+static unsigned long long xxh64( const void* data, size_t len, unsigned long long seed )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    unsigned long long h;
+
+    if ( len >= 32 )
+    {
+	unsigned long long v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	unsigned long long v2 = seed + XXH_PRIME64_2;
+	unsigned long long v3 = seed;
+	unsigned long long v4 = seed - XXH_PRIME64_1;
+
+	do
+	{
+	    v1 = xxh_round( v1, xxh_read64( p ) );
+	    v2 = xxh_round( v2, xxh_read64( p + 8 ) );
+	    v3 = xxh_round( v3, xxh_read64( p + 16 ) );
+	    v4 = xxh_round( v4, xxh_read64( p + 24 ) );
+	    p += 32;
+	}
+	while ( p + 32 <= end );
+
+	h = xxh_converge( v1, v2, v3, v4 );
+    }
+    else
+	h = seed + XXH_PRIME64_5;
+
+    h += len;
+
+    return xxh_finish( h, p, end );
+}
+
+// the same digest fed a piece at a time, for data read from a file in
+// chunks.  the result is exactly what xxh64() gives over the whole.
+
+typedef struct
+{
+    unsigned long long v1, v2, v3, v4;
+    unsigned long long seed;
+    unsigned long long total;
+    unsigned char buf[32];      // a partial stripe carried to the next call
+    size_t buffered;
+} xxh_state;
+
+static void xxh64_begin( xxh_state* st, unsigned long long seed )
+{
+    st->v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v2 = seed + XXH_PRIME64_2;
+    st->v3 = seed;
+    st->v4 = seed - XXH_PRIME64_1;
+    st->seed = seed;
+    st->total = 0;
+    st->buffered = 0;
+}
+
+static void xxh64_stripe( xxh_state* st, const unsigned char* p )
+{
+    st->v1 = xxh_round( st->v1, xxh_read64( p ) );
+    st->v2 = xxh_round( st->v2, xxh_read64( p + 8 ) );
+    st->v3 = xxh_round( st->v3, xxh_read64( p + 16 ) );
+    st->v4 = xxh_round( st->v4, xxh_read64( p + 24 ) );
+}
+
+static void xxh64_feed( xxh_state* st, const void* data, size_t len )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    size_t n;
+
+    st->total += len;
+
+    if ( st->buffered > 0 )
+    {
+	n = 32 - st->buffered < len ? 32 - st->buffered : len;
+	memcpy( st->buf + st->buffered, p, n );
+	st->buffered += n;
+	p += n;
+	if ( st->buffered < 32 )
+	    return;
+	xxh64_stripe( st, st->buf );
+	st->buffered = 0;
+    }
+
+    for ( ; p + 32 <= end; p += 32 )
+	xxh64_stripe( st, p );
+
+    memcpy( st->buf, p, end - p );
+    st->buffered = end - p;
+}
+
+static unsigned long long xxh64_end( const xxh_state* st )
+{
+    unsigned long long h;
+
+    if ( st->total >= 32 )
+	h = xxh_converge( st->v1, st->v2, st->v3, st->v4 );
+    else
+	h = st->seed + XXH_PRIME64_5;
+
+    h += st->total;
+
+    return xxh_finish( h, st->buf, st->buf + st->buffered );
+}
+
+// a frame's digest covers its ID and, for each field, the field's ID,
+// type, encoding and contents -- the same things diff() compares.
+// each piece is chained in as the seed of the next, and everything is
+// laid out byte by byte so the result is the same on any machine.
+// a payload left in the file is hashed as it is read back, a chunk at
+// a time.  returns -1 with errno set if one can't be.
+
+static int frame_digest( ID3Object* owner, ID3_Frame* frame, unsigned long long* digest )
+{
+    unsigned char hdr[16];
+    const deferred_payload* ref;
+    unsigned long long h;
+    const void* data;
+    size_t len;
+    void* buf;
+    int i, err;
+
+    h = xxh64( NULL, 0, frame->GetID() );
+    
+    ID3_Frame::Iterator* fiter = frame->CreateIterator();
+    ID3_Field* field;
+    while ( (field = fiter->GetNext()) )
+    {
+	unsigned long vals[4];
+	unsigned char num[4];
+	
+	buf = NULL;
+	ref = NULL;
+	if ( field->GetType() == ID3FTY_INTEGER )
+	{
+	    unsigned long v = field->Get();
+	    for ( i = 0; i < 4; ++i )
+		num[i] = (v >> (8 * i)) & 0xff;
+	    data = num;
+	    len = 4;
+	}
+	else if ( field->GetType() == ID3FTY_BINARY && (ref = payload_find( owner, field )) != NULL )
+	{
+	    data = NULL;
+	    len = ref->length;
+	}
+	else
+	    field_raw( owner, field, &data, &len, &buf );
+	if ( data == NULL && ref == NULL )
+	    len = 0;
+
+	vals[0] = field->GetID();
+	vals[1] = field->GetType();
+	vals[2] = field->GetType() == ID3FTY_TEXTSTRING ? field->GetEncoding() : 0;
+	vals[3] = len;
+	for ( i = 0; i < 16; ++i )
+	    hdr[i] = (vals[i / 4] >> (8 * (i % 4))) & 0xff;
+	
+	h = xxh64( hdr, sizeof( hdr ), h );
+	if ( ref == NULL )
+	    h = xxh64( data, len, h );
+	else if ( payload_hash( owner, ref, h, &h ) < 0 )
+	{
+	    err = errno;
+	    delete fiter;
+	    errno = err;
+	    return -1;
+	}
+	free( buf );
+    }
+    delete fiter;
+
+    *digest = h;
+    return 0;
+}
+
+static int digest_compare( const void* a, const void* b )
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// fill in the per-frame digest cache.  scan( digests=True ) runs this
+// on the worker threads, so it mustn't touch Python.  the cache is
+// only trusted while the tag is clean, and is thrown away whenever the
+// tag is reloaded or written.  if a frame can't be hashed there's no
+// cache, and digest() works it out (and reports the error) itself.
+
+static void id3_compute_digests( ID3Object* self )
+{
+    int i;
+
+    digest_cache_clear( self );
+    self->digests = (unsigned long long*)malloc( (self->size + 1) * sizeof( unsigned long long ) );
+    if ( self->digests == NULL )
+	return;
+
+    for ( i = 0; i < self->size; ++i )
+	if ( frame_digest( self, self->frames[i], &self->digests[i] ) < 0 )
+	{
+	    digest_cache_clear( self );
+	    return;
+	}
+}
+
+static void digest_cache_clear( ID3Object* self )
+{
+    free( self->digests );
+    self->digests = NULL;
+}
+
+// tag.digest( i ) is the digest of frame i.  tag.digest() covers
+// the whole set of frames: it's the digest of their individual
+// digests in sorted order, so like diff() it ignores the order of the
+// frames but not how many times each one appears.
+
+static PyObject* id3_digest( ID3Object* self, PyObject* args )
+{
+    unsigned long long* all;
+    unsigned char* bytes;
+    unsigned long long h;
+    int index = -1;
+    int i, cached;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( !PyArg_ParseTuple( args, "|i:digest", &index ) )
+	return NULL;
+
+    cached = self->digests != NULL && !self->dirty;
+    
+    if ( PyTuple_GET_SIZE( args ) > 0 )
+    {
+	if ( index < 0 )
+	    index += self->size;
+	if ( index < 0 || index >= self->size )
+	{
+	    PyErr_SetString( PyExc_IndexError, "frame index out of range" );
+	    return NULL;
+	}
+	
+	if ( cached )
+	    h = self->digests[index];
+	else if ( frame_digest( self, self->frames[index], &h ) < 0 )
+	    return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)id3_filename( self ) );
+	return PyLong_FromUnsignedLongLong( h );
+    }
+
+    all = new unsigned long long [self->size + 1];
+    for ( i = 0; i < self->size; ++i )
+    {
+	if ( cached )
+	    all[i] = self->digests[i];
+	else if ( frame_digest( self, self->frames[i], &all[i] ) < 0 )
+	{
+	    delete [] all;
+	    return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)id3_filename( self ) );
+	}
+    }
+    bytes = new unsigned char [self->size * 8 + 1];
+    qsort( all, self->size, sizeof( unsigned long long ), digest_compare );
+
+    for ( i = 0; i < self->size * 8; ++i )
+	bytes[i] = (all[i / 8] >> (8 * (i % 8))) & 0xff;
+    h = xxh64( bytes, self->size * 8, 0 );
+    
+    delete [] all;
+    delete [] bytes;
+
+    return PyLong_FromUnsignedLongLong( h );
+}
+
+// the audio between the tags, as audio_bounds() finds it, read and
+// hashed a chunk at a time.  reading rather than mapping the file
+// means one that is cut short meanwhile is an error, not a SIGBUS.
+// sets errno and returns -1 if the file can't be read.  doesn't touch
+// Python.
+
+#define AUDIO_CHUNK  (1024 * 1024)
+
+static int audio_region_digest( const char* filename, unsigned long long* digest )
+{
+    struct stat st;
+    xxh_state state;
+    char* buf;
+    unsigned long long start, end, pos;
+    ssize_t n;
+    int fd, err;
+
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+	return -1;
+    if ( fstat( fd, &st ) < 0 )
+    {
+	close( fd );
+	return -1;
+    }
+
+    audio_bounds( fd, st.st_size, &start, &end );
+    if ( start >= end )
+    {
+	close( fd );
+	*digest = xxh64( NULL, 0, 0 );
+	return 0;
+    }
+
+    buf = (char*)malloc( AUDIO_CHUNK );
+    if ( buf == NULL )
+    {
+	close( fd );
+	errno = ENOMEM;
+	return -1;
+    }
+
+    posix_fadvise( fd, start, end - start, POSIX_FADV_SEQUENTIAL );
+    xxh64_begin( &state, 0 );
+    for ( pos = start; pos < end; pos += n )
+    {
+	n = pread( fd, buf, end - pos < AUDIO_CHUNK ? end - pos : AUDIO_CHUNK, pos );
+	if ( n <= 0 )
+	{
+	    err = n < 0 ? errno : EIO;
+	    free( buf );
+	    close( fd );
+	    errno = err;
+	    return -1;
+	}
+	xxh64_feed( &state, buf, n );
+    }
+    free( buf );
+    close( fd );
+
+    *digest = xxh64_end( &state );
+    return 0;
+}
+
+// the digest of the audio in the file this tag was read from, so
+// identical recordings can be found whatever their tags say.
+
+static PyObject* id3_audio_digest( ID3Object* self )
+{
+    unsigned long long digest;
+    const char* filename;
+    int result;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    filename = id3_filename( self );
+    if ( filename == NULL || filename[0] == 0 )
+    {
+	PyErr_SetString( ID3Error, "tag is not linked to a file" );
+	return NULL;
+    }
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    result = audio_region_digest( filename, &digest );
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if ( result < 0 )
+	return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)filename );
+    
+    return PyLong_FromUnsignedLongLong( digest );
+}
+
+// pyid3lib.audio_digests( filenames, threads=0 ): the same thing for a
+// whole batch of files, spread over a set of native threads with the
+// interpreter lock released throughout.  files that can't be read
+// come back as None.
+
+typedef struct
+{
+    const char** names;
+    unsigned long long* digests;
+    char* ok;
+    long n;
+    long next;
+    pthread_mutex_t mutex;
+} audio_batch;
+
+static void* audio_batch_worker( void* arg )
+{
+    audio_batch* batch = (audio_batch*)arg;
+    long i;
+
+    for ( ;; )
+    {
+	pthread_mutex_lock( &batch->mutex );
+	i = batch->next++;
+	pthread_mutex_unlock( &batch->mutex );
+	if ( i >= batch->n )
+	    break;
+
+	batch->ok[i] = audio_region_digest( batch->names[i], &batch->digests[i] ) == 0;
+    }
+
+    return NULL;
+}
+
+static PyObject* audio_digests( PyObject* self, PyObject* args, PyObject* kwds )
+{
+    static char* kwlist[] = { "filenames", "threads", NULL };
+    PyObject* seq;
+    PyObject* list;
+    PyObject* result = NULL;
+    PyObject* item;
+    pthread_t* threads;
+    audio_batch batch;
+    int nthreads = 0;
+    int i, started;
+
+    if ( !PyArg_ParseTupleAndKeywords( args, kwds, "O|i:audio_digests", kwlist,
+				       &seq, &nthreads ) )
+	return NULL;
+    if ( nthreads < 0 || nthreads > SCAN_MAX_THREADS )
+    {
+	PyErr_Format( PyExc_ValueError, "audio_digests() threads must be between 0 and %d",
+		      SCAN_MAX_THREADS );
+	return NULL;
+    }
+
+    list = PySequence_List( seq );
+    if ( list == NULL )
+	return NULL;
+
+    batch.n = PyList_GET_SIZE( list );
+    batch.next = 0;
+    for ( i = 0; i < batch.n; ++i )
+	if ( !PyString_Check( PyList_GET_ITEM( list, i ) ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "audio_digests() requires a sequence of filenames" );
+	    Py_DECREF( list );
+	    return NULL;
+	}
+
+    batch.names = new const char* [batch.n + 1];
+    batch.digests = new unsigned long long [batch.n + 1];
+    batch.ok = new char [batch.n + 1];
+    for ( i = 0; i < batch.n; ++i )
+	batch.names[i] = PyString_AS_STRING( PyList_GET_ITEM( list, i ) );
+    pthread_mutex_init( &batch.mutex, NULL );
+    threads = new pthread_t [nthreads + 1];
+
+    Py_BEGIN_ALLOW_THREADS
+    for ( started = 0; started < nthreads; ++started )
+	if ( pthread_create( &threads[started], NULL, audio_batch_worker, &batch ) != 0 )
+	    break;
+    
+    // this thread does its share too, and all of it if there are no
+    // other threads.
+    audio_batch_worker( &batch );
+    
+    for ( i = 0; i < started; ++i )
+	pthread_join( threads[i], NULL );
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New( batch.n );
+    for ( i = 0; result != NULL && i < batch.n; ++i )
+    {
+	if ( batch.ok[i] )
+	    item = PyLong_FromUnsignedLongLong( batch.digests[i] );
+	else
+	{
+	    item = Py_None;
+	    Py_INCREF( item );
+	}
+	if ( item == NULL )
+	    Py_CLEAR( result );
+	else
+	    PyList_SET_ITEM( result, i, item );
+    }
+
+    pthread_mutex_destroy( &batch.mutex );
+    delete [] threads;
+    delete [] batch.names;
+    delete [] batch.digests;
+    delete [] batch.ok;
+    Py_DECREF( list );
+
+    return result;
+}
+
+/////////////////////
+//
+//  MPEG stream information
+//
+/////////////////////
+
+// id3lib decodes the first frame header and a Xing header, but knows
+// nothing of VBRI headers, and for a VBR file without either of them
+// it can only guess from that first frame.  so we read the headers
+// ourselves: the first frame, then a Xing/Info or VBRI header in it,
+// and failing both, frames sampled from STREAM_SAMPLES places spread
+// through the audio.  the amount read is bounded whatever the size of
+// the file.
+
+#define STREAM_SAMPLES      8
+#define STREAM_SAMPLE_BYTES 4096
+
+typedef struct
+{
+    int version;            // 10, 20 or 25
+    int layer;
+    int bitrate;            // kbps
+    int samplerate;
+    int mode;
+    int length;             // bytes, including the header
+    int samples;            // per frame
+} mpeg_frame;
+
+static const short mpeg_bitrates[2][3][15] = {
+    {   // MPEG 1
+	{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+	{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    },
+    {   // MPEG 2 and 2.5
+	{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    },
+};
+
+static const int mpeg_samplerates[3][3] = {
+    { 44100, 48000, 32000 },    // MPEG 1
+    { 22050, 24000, 16000 },    // MPEG 2
+    { 11025, 12000, 8000 },     // MPEG 2.5
+};
+
+static const char* mpeg_modes[4] = { "stereo", "joint stereo", "dual channel", "mono" };
+
+static unsigned long read_be32( const unsigned char* p )
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+	((unsigned long)p[2] << 8) | p[3];
+}
+
+// decode a 4-byte frame header.  returns 0 if it isn't one.
+
+static int mpeg_header( const unsigned char* p, mpeg_frame* f )
+{
+    unsigned long h = read_be32( p );
+    int vbits, lbits, bindex, sindex, padding, v;
+
+    if ( (h & 0xffe00000UL) != 0xffe00000UL )
+	return 0;
+
+    vbits = (h >> 19) & 3;
+    lbits = (h >> 17) & 3;
+    bindex = (h >> 12) & 15;
+    sindex = (h >> 10) & 3;
+    padding = (h >> 9) & 1;
+    if ( vbits == 1 || lbits == 0 || bindex == 0 || bindex == 15 || sindex == 3 )
+	return 0;
+
+    f->version = vbits == 3 ? 10 : vbits == 2 ? 20 : 25;
+    f->layer = 4 - lbits;
+    v = f->version == 10 ? 0 : 1;
+    f->bitrate = mpeg_bitrates[v][f->layer - 1][bindex];
+    f->samplerate = mpeg_samplerates[f->version == 10 ? 0 : f->version == 20 ? 1 : 2][sindex];
+    f->mode = (h >> 6) & 3;
+
+    if ( f->layer == 1 )
+    {
+	f->samples = 384;
+	f->length = (12000 * f->bitrate / f->samplerate + padding) * 4;
+    }
+    else
+    {
+	f->samples = (f->layer == 3 && v) ? 576 : 1152;
+	f->length = f->samples / 8 * 1000 * f->bitrate / f->samplerate + padding;
+    }
+
+    return 1;
+}
+
+// find the first frame in the buffer whose successor (if it fits in
+// the buffer) is also a frame of the same kind.
+
+static int mpeg_find_frame( const unsigned char* buf, int len, mpeg_frame* f )
+{
+    mpeg_frame next;
+    int i;
+
+    for ( i = 0; i + 4 <= len; ++i )
+    {
+	if ( buf[i] != 0xff || !mpeg_header( buf + i, f ) )
+	    continue;
+	if ( i + f->length + 4 > len )
+	    return i;
+	if ( mpeg_header( buf + i + f->length, &next ) &&
+	     next.version == f->version && next.layer == f->layer &&
+	     next.samplerate == f->samplerate )
+	    return i;
+    }
+
+    return -1;
+}
+
+static int stream_info_read( const char* filename, stream_info* info )
+{
+    unsigned char buf[STREAM_SAMPLE_BYTES];
+    struct stat st;
+    mpeg_frame f, g;
+    unsigned long long start, end, audio;
+    unsigned long frames = 0;
+    long total = 0, count = 0;
+    int first = -1;
+    int fd, n, i, pos, off;
+
+    memset( info, 0, sizeof( *info ) );
+    
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+	return -1;
+    if ( fstat( fd, &st ) < 0 )
+    {
+	close( fd );
+	return -1;
+    }
+    audio_bounds( fd, st.st_size, &start, &end );
+    if ( start >= end )
+    {
+	close( fd );
+	return 0;
+    }
+
+    n = pread( fd, buf, sizeof( buf ), start );
+    if ( n > 0 )
+	first = mpeg_find_frame( buf, n, &f );
+    if ( first < 0 )
+    {
+	close( fd );
+	return 0;
+    }
+    audio = end - start - first;
+    
+    info->version = f.version;
+    info->layer = f.layer;
+    info->samplerate = f.samplerate;
+    info->mode = f.mode;
+
+    // a Xing or Info header sits just past the side information in
+    // the first frame; a VBRI header always 32 bytes past the header.
+    
+    off = first + 4 + (f.version == 10 ? (f.mode == 3 ? 17 : 32) : (f.mode == 3 ? 9 : 17));
+    if ( off + 12 <= n && (memcmp( buf + off, "Xing", 4 ) == 0 ||
+			   memcmp( buf + off, "Info", 4 ) == 0) &&
+	 (read_be32( buf + off + 4 ) & 1) )
+    {
+	frames = read_be32( buf + off + 8 );
+	info->source = STREAM_XING;
+	info->vbr = memcmp( buf + off, "Xing", 4 ) == 0;
+    }
+    off = first + 4 + 32;
+    if ( info->source == STREAM_NONE && off + 18 <= n && memcmp( buf + off, "VBRI", 4 ) == 0 )
+    {
+	frames = read_be32( buf + off + 14 );
+	info->source = STREAM_VBRI;
+	info->vbr = 1;
+    }
+
+    if ( frames > 0 )
+    {
+	info->duration = (double)frames * f.samples / f.samplerate;
+	info->bitrate = (int)(audio * 8 / info->duration / 1000 + 0.5);
+	close( fd );
+	return 0;
+    }
+
+    // no header: average the bitrate over frames taken from several
+    // places in the file.
+    
+    info->source = STREAM_SCAN;
+    for ( i = 0; i < STREAM_SAMPLES; ++i )
+    {
+	pos = 0;
+	if ( i > 0 )
+	{
+	    n = pread( fd, buf, sizeof( buf ), start + first + audio * i / STREAM_SAMPLES );
+	    if ( n <= 0 || (pos = mpeg_find_frame( buf, n, &g )) < 0 )
+		continue;
+	}
+	else
+	    pos = first;
+
+	while ( pos + 4 <= n && mpeg_header( buf + pos, &g ) &&
+		g.version == f.version && g.layer == f.layer && g.samplerate == f.samplerate )
+	{
+	    if ( g.bitrate != f.bitrate )
+		info->vbr = 1;
+	    total += g.bitrate;
+	    ++count;
+	    pos += g.length;
+	}
+    }
+    close( fd );
+
+    info->bitrate = (int)((total + count / 2) / count);
+    info->duration = audio * 8.0 / (info->bitrate * 1000.0);
+
+    return 0;
+}
+
+// look up the stream details for the tag's file.  run without the
+// interpreter lock.
+
+static void id3_compute_stream( ID3Object* self )
+{
+    const char* filename = id3_filename( self );
+
+    if ( self->stream == NULL )
+	self->stream = (stream_info*)malloc( sizeof( stream_info ) );
+    if ( self->stream == NULL )
+	return;
+
+    if ( filename == NULL || filename[0] == 0 ||
+	 stream_info_read( filename, self->stream ) < 0 )
+	self->stream->source = STREAM_NONE;
+}
+
+// tag.stream_info() returns a dictionary describing the audio, or None
+// if no MPEG audio could be found.  the file is only read the first
+// time; after that (or if the tag came from scan( streams=True )) the
+// stored answer is used.
+
+static PyObject* id3_stream_info( ID3Object* self )
+{
+    static const char* sources[] = { NULL, "xing", "vbri", "scan" };
+    stream_info* info;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( self->stream == NULL )
+    {
+	self->busy = 1;
+	Py_BEGIN_ALLOW_THREADS
+	id3_compute_stream( self );
+	Py_END_ALLOW_THREADS
+	self->busy = 0;
+	
+	if ( self->stream == NULL )
+	    return PyErr_NoMemory();
+    }
+
+    info = self->stream;
+    if ( info->source == STREAM_NONE )
+    {
+	Py_INCREF( Py_None );
+	return Py_None;
+    }
+
+    return Py_BuildValue( "{s:d,s:i,s:i,s:i,s:s,s:d,s:N,s:s}",
+			  "version", info->version / 10.0,
+			  "layer", info->layer,
+			  "bitrate", info->bitrate,
+			  "samplerate", info->samplerate,
+			  "channelmode", mpeg_modes[info->mode],
+			  "duration", info->duration,
+			  "vbr", PyBool_FromLong( info->vbr ),
+			  "source", sources[info->source] );
+}
+
+/////////////////////
+//
+//  accessing frames via "magic attributes"
+//
+/////////////////////
+
+enum frame_type
+{
+    PYFD_Text,
+    PYFD_Tracknum,
+    PYFD_Year,
+    PYFD_URL,
+};
+
+typedef struct
+{
+    char* name;
+    ID3_FrameID fid;
+    frame_type type;
+
+    PyObject* nameobj;          // interned copy of name, set up at init
+} magic_attribute;
+
+static int magic_attribute_table_size = -1;
+
+// this list is kept sorted by the "name" field, since that's the
+// order they come back in from __members__.
+static magic_attribute magic_attribute_table[] = {
+    { "album",              ID3FID_ALBUM,                PYFD_Text },
+    { "artist",             ID3FID_LEADARTIST,           PYFD_Text },    // synonym
+    { "band",               ID3FID_BAND,                 PYFD_Text },
+    { "bpm",                ID3FID_BPM,                  PYFD_Text },
+    { "composer",           ID3FID_COMPOSER,             PYFD_Text },
     { "conductor",          ID3FID_CONDUCTOR,            PYFD_Text },
     { "contentgroup",       ID3FID_CONTENTGROUP,         PYFD_Text },
     { "contenttype",        ID3FID_CONTENTTYPE,          PYFD_Text },
@@ -964,269 +3871,1440 @@ static magic_attribute magic_attribute_table[] = {
     { NULL },
 };    
 
-static int magic_attribute_compare( const void* a, const void *b )
+// open-addressed hash table over magic_attribute_table, keyed by the
+// (cached) hash of the interned attribute name.  attribute names that
+// come from Python source are interned, so a lookup is normally one
+// probe and one pointer comparison.
+
+#define MAGIC_HASH_SIZE  128
+
+static magic_attribute* magic_attribute_hash[MAGIC_HASH_SIZE];
+
+// the names returned by __members__.
+static PyObject* magic_memberlist;
+
+static void magic_attribute_hash_init( void )
+{
+    magic_attribute* p;
+    int i, j;
+
+    magic_memberlist = PyList_New( 0 );
+    
+    for ( i = 0; i < magic_attribute_table_size; ++i )
+    {
+	p = &magic_attribute_table[i];
+	p->nameobj = PyString_InternFromString( p->name );
+	PyList_Append( magic_memberlist, p->nameobj );
+
+	j = PyObject_Hash( p->nameobj ) & (MAGIC_HASH_SIZE-1);
+	while ( magic_attribute_hash[j] != NULL )
+	    j = (j+1) & (MAGIC_HASH_SIZE-1);
+	magic_attribute_hash[j] = p;
+    }
+
+    PyObject* track = PyString_InternFromString( "track" );
+    PyList_Append( magic_memberlist, track );
+    Py_DECREF( track );
+}
+
+static magic_attribute* magic_attribute_lookup( PyObject* name )
+{
+    magic_attribute* p;
+    long h;
+    int j;
+
+    h = PyObject_Hash( name );
+    j = h & (MAGIC_HASH_SIZE-1);
+    while ( (p = magic_attribute_hash[j]) != NULL )
+    {
+	if ( p->nameobj == name )
+	    return p;
+	if ( PyObject_Hash( p->nameobj ) == h && _PyString_Eq( p->nameobj, name ) )
+	    return p;
+	j = (j+1) & (MAGIC_HASH_SIZE-1);
+    }
+
+    return NULL;
+}
+
+static PyObject* id3_getattro( ID3Object* self, PyObject* name )
+{
+    PyObject* result = NULL;
+    magic_attribute* p;
+    char* attrname;
+    int i, n;
+
+    if ( !PyString_Check( name ) )
+	return PyObject_GenericGetAttr( (PyObject*)self, name );
+    attrname = PyString_AS_STRING( name );
+
+    if ( attrname[0] == '_' && strcmp( attrname, "__members__" ) == 0 )
+    {
+        PyObject* temp;
+
+        // make a copy of the memberlist to return
+        
+        n = PyList_Size( magic_memberlist );
+        result = PyList_New( n );
+        for ( i = 0; i < n; ++i )
+        {
+            temp = PyList_GET_ITEM( magic_memberlist, i );
+            Py_INCREF( temp );
+            PyList_SET_ITEM( result, i, temp );
+        }
+            
+        return result;
+    }
+    
+    if ( (p = magic_attribute_lookup( name )) )
+    {
+        ID3_Frame* frame;
+	const char* str;
+	char* slash;
+        ID3_Field* fld;
+	int i;
+
+	CHECK_NOT_BUSY( self, NULL );
+
+	frame = NULL;
+	for ( i = 0; i < self->size; ++i )
+	    if ( self->frames[i]->GetID() == p->fid )
+	    {
+		frame = self->frames[i];
+		break;
+	    }
+
+        if ( frame == NULL )
+        {
+	    PyErr_Format( PyExc_AttributeError, "tag has no '%s' frame", attrname );
+	    result = NULL;
+	    goto done;
+        }
+        
+        switch( p->type )
+        {
+          case PYFD_Text:
+            fld = frame->GetField( ID3FN_TEXT );
+            n = fld->Size();
+            result = PyString_FromStringAndSize( fld->GetRawText(), n );
+            break;
+
+          case PYFD_URL:
+            fld = frame->GetField( ID3FN_URL );
+            n = fld->Size();
+            result = PyString_FromStringAndSize( fld->GetRawText(), n );
+            break;
+	    
+          case PYFD_Year:
+	    result = PyInt_FromLong( atoi( frame->GetField( ID3FN_TEXT )->GetRawText() ) );
+	    break;
+
+          case PYFD_Tracknum:
+            fld = frame->GetField( ID3FN_TEXT );
+            str = fld->GetRawText();
+            
+            if ( (slash = strchr( str, '/' )) != NULL )
+                result = Py_BuildValue( "ii", atoi( str ), atoi( slash+1 ) );
+            else
+                result = Py_BuildValue( "(i)", atoi( str ) );
+            break;
+        }
+    }
+    else
+        result = PyObject_GenericGetAttr( (PyObject*)self, name );
+
+done:
+    return result;
+}
+
+static int id3_setattro( ID3Object* self, PyObject* name, PyObject* val )
+{
+    ID3_Frame* newframe;
+    ID3_Field* field;
+    magic_attribute* p;
+    char* attrname;
+
+    if ( !PyString_Check( name ) )
+    {
+	PyErr_SetString( PyExc_TypeError, "attribute name must be string" );
+	return -1;
+    }
+    attrname = PyString_AS_STRING( name );
+
+    if ( (p = magic_attribute_lookup( name )) )
+    {
+	int i, j;
+
+	CHECK_NOT_BUSY( self, -1 );
+	
+	// for "del x.attr" or "x.attr = None", just delete all frames
+	// of the appropriate type.
+        if ( val == NULL || val == Py_None )
+        {
+	    j = 0;
+	    for ( i = 0; i < self->size; ++i )
+	    {
+		if ( self->frames[i]->GetID() == p->fid )
+		    frame_drop( self, self->frames[i] );
+		else
+		    self->frames[j++] = self->frames[i];
+	    }
+	    if ( j < self->size )
+		self->dirty = 1;
+	    self->size = j;
+	    
+            return 0;
+        }
+
+	newframe = NULL;
+	
+	switch( p->type )
+	{
+	  case PYFD_Text:
+	    if ( !PyString_Check( val ) )
+	    {
+		PyErr_Format( ID3Error, "'%s' attribute must be string", attrname );
+		return -1;
+	    }
+		
+	    newframe = new ID3_Frame( p->fid );
+	    newframe->GetField( ID3FN_TEXT )->Set( PyString_AsString( val ) );
+	    break;
+		
+	  case PYFD_URL:
+	    if ( !PyString_Check( val ) )
+	    {
+		PyErr_Format( ID3Error, "'%s' attribute must be string", attrname );
+		return -1;
+	    }
+
+	    newframe = new ID3_Frame( p->fid );
+	    newframe->GetField( ID3FN_URL )->Set( PyString_AsString( val ) );
+	    break;
+
+	  case PYFD_Year:
+	    newframe = new ID3_Frame( p->fid );
+	    field = newframe->GetField( ID3FN_TEXT );
+		
+	    if ( PyString_Check( val ) )
+		field->Set( PyString_AsString( val ) );
+	    else if ( PyInt_Check( val ) )
+	    {
+		char buffer[20];
+		sprintf( buffer, "%04ld", PyInt_AsLong( val ) );
+		field->Set( buffer );
+	    }
+	    else
+	    {
+		delete newframe;
+		PyErr_Format( ID3Error, "'%s' attribute must be string or int", attrname );
+		return -1;
+	    }
+	    break;
+
+	  case PYFD_Tracknum:
+	    newframe = new ID3_Frame( p->fid );
+	    field = newframe->GetField( ID3FN_TEXT );
+		
+	    if ( PyString_Check( val ) )
+		field->Set( PyString_AsString( val ) );
+	    else if ( PyInt_Check( val ) )
+	    {
+		char buffer[20];
+		sprintf( buffer, "%ld", PyInt_AsLong( val ) );
+		field->Set( buffer );
+	    }
+	    else if ( PyTuple_Check( val ) )
+	    {
+		if ( PyTuple_Size( val ) == 1 &&
+		     PyInt_Check( PyTuple_GetItem( val, 0 ) ) )
+		{
+		    char buffer[20];
+		    sprintf( buffer, "%ld", PyInt_AsLong( PyTuple_GetItem( val, 0 ) ) );
+		    field->Set( buffer );
+		}
+		else if ( PyTuple_Size( val ) == 2 &&
+			  PyInt_Check( PyTuple_GetItem( val, 0 ) ) &&
+			  PyInt_Check( PyTuple_GetItem( val, 1 ) ) )
+		{
+		    char buffer[40];
+		    sprintf( buffer, "%ld/%ld",
+			     PyInt_AsLong( PyTuple_GetItem( val, 0 ) ),
+			     PyInt_AsLong( PyTuple_GetItem( val, 1 ) ) );
+		    field->Set( buffer );
+		}
+		else
+		{
+		    delete newframe;
+		    newframe = NULL;
+		}
+	    }
+	    else
+	    {
+		delete newframe;
+		newframe = NULL;
+	    }
+
+	    if ( newframe == NULL )
+	    {
+		PyErr_Format( ID3Error, "'%s' attribute must be string or int or (int,) or (int,int)", attrname );
+		return -1;
+	    }
+	    break;
+	}
+
+	// if we reach this point, newframe should have a good frame in it.
+	// remove all old instances of this type and attach the new frame.
+        
+	j = 0;
+	for ( i = 0; i < self->size; ++i )
+	{
+	    if ( self->frames[i]->GetID() == p->fid )
+		frame_drop( self, self->frames[i] );
+	    else
+		self->frames[j++] = self->frames[i];
+	}
+	self->size = j;
+
+	if ( id3_reserve( self, self->size + 1 ) < 0 )
+	{
+	    PyErr_NoMemory();
+	    delete newframe;
+	    return -1;
+	}
+
+	self->frames[self->size++] = newframe;
+	self->dirty = 1;
+
+	return 0;
+    }
+    
+    PyErr_Format( PyExc_AttributeError, "'%s' object has no attribute '%s'",
+		  ID3Type.tp_name, attrname );
+    return -1;
+    
+}
+
+
+
+/////////////////////
+//
+//   reading only some tag versions
+//
+/////////////////////
+
+// tag(), reopen() and scan() take versions='v1' or versions='v2' to
+// read (and later write) only that kind of tag.  for 'v2' we just pass
+// the flag on to id3lib.  for 'v1', id3lib would still open the file
+// as a stream, look for a v2 header and decode the mpeg header, all to
+// get at the last 128 bytes, so we read those ourselves with a single
+// pread() and only link the ID3_Tag if the file is written (or its
+// audio is wanted) later.
+
+static int parse_versions( const char* name, flags_t* versions, const char* func )
+{
+    if ( name == NULL )
+	*versions = ID3TT_ALL;
+    else if ( strcmp( name, "v1" ) == 0 )
+	*versions = ID3TT_ID3V1;
+    else if ( strcmp( name, "v2" ) == 0 )
+	*versions = ID3TT_ID3V2;
+    else
+    {
+	PyErr_Format( PyExc_ValueError, "%s() versions must be 'v1' or 'v2', not '%s'",
+		      func, name );
+	return -1;
+    }
+
+    return 0;
+}
+
+static void id3v1_add( ID3Object* self, ID3_Frame* frame )
+{
+    if ( id3_reserve( self, self->size + 1 ) == 0 )
+	self->frames[self->size++] = frame;
+    else
+	delete frame;
+}
+
+// one of the fixed-width text fields: padded with spaces or nulls, and
+// not necessarily null-terminated.  empty fields don't become frames,
+// the same as when id3lib reads the tag.
+
+static ID3_Frame* id3v1_text( ID3Object* self, ID3_FrameID fid,
+			      const unsigned char* p, int len )
+{
+    char text[31];
+    ID3_Frame* frame;
+    
+    memcpy( text, p, len );
+    text[len] = 0;
+    len = strlen( text );
+    while ( len > 0 && text[len-1] == ' ' )
+	text[--len] = 0;
+    if ( len == 0 )
+	return NULL;
+
+    frame = new ID3_Frame( fid );
+    frame->GetField( ID3FN_TEXT )->Set( text );
+    id3v1_add( self, frame );
+
+    return frame;
+}
+
+// returns the number of bytes read from the file.
+
+static size_t id3v1_read( ID3Object* self, const char* filename )
+{
+    unsigned char buf[ID3V1_SIZE];
+    struct stat st;
+    ID3_Frame* frame;
+    char number[8];
+    int fd, n = -1;
+
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+	return 0;
+    if ( fstat( fd, &st ) == 0 && st.st_size >= ID3V1_SIZE )
+	n = pread( fd, buf, ID3V1_SIZE, st.st_size - ID3V1_SIZE );
+    close( fd );
+    
+    if ( n != ID3V1_SIZE || memcmp( buf, "TAG", 3 ) != 0 )
+	return n > 0 ? n : 0;
+    self->ondisk = ID3TT_ID3V1;
+
+    id3v1_text( self, ID3FID_TITLE, buf + 3, 30 );
+    id3v1_text( self, ID3FID_LEADARTIST, buf + 33, 30 );
+    id3v1_text( self, ID3FID_ALBUM, buf + 63, 30 );
+    id3v1_text( self, ID3FID_YEAR, buf + 93, 4 );
+
+    // ID3v1.1 takes the last two bytes of the comment for a zero and
+    // the track number.
+    if ( buf[125] == 0 && buf[126] != 0 )
+    {
+	frame = id3v1_text( self, ID3FID_COMMENT, buf + 97, 28 );
+	sprintf( number, "%d", buf[126] );
+	id3v1_text( self, ID3FID_TRACKNUM, (unsigned char*)number, strlen( number ) );
+    }
+    else
+	frame = id3v1_text( self, ID3FID_COMMENT, buf + 97, 30 );
+    if ( frame )
+    {
+	frame->GetField( ID3FN_DESCRIPTION )->Set( "ID3v1 Comment" );
+	frame->GetField( ID3FN_LANGUAGE )->Set( "XXX" );
+    }
+
+    if ( buf[127] != 0xff )
+    {
+	sprintf( number, "(%d)", buf[127] );
+	id3v1_text( self, ID3FID_CONTENTTYPE, (unsigned char*)number, strlen( number ) );
+    }
+
+    return ID3V1_SIZE;
+}
+
+// link the ID3_Tag of a tag that was read with versions='v1'.  the
+// frames id3lib reads in the process are dropped, since we already
+// have our own.  may be run without the interpreter lock.
+
+static void id3_link( ID3Object* self )
+{
+    ID3_Tag::Iterator* titer;
+    ID3_Frame* frame;
+
+    if ( self->filename == NULL )
+	return;
+    
+    self->tag->Link( self->filename, self->versions );
+
+    titer = self->tag->CreateIterator();
+    while ( (frame = titer->GetNext()) )
+	delete self->tag->RemoveFrame( frame );
+    delete titer;
+
+    free( self->filename );
+    self->filename = NULL;
+}
+
+static const char* id3_filename( ID3Object* self )
+{
+    return self->filename ? self->filename : self->tag->GetFileName();
+}
+
+/////////////////////
+//
+//   leaving large payloads in the file
+//
+/////////////////////
+
+// with maxbinary=N, the contents of any binary field (a picture, an
+// encapsulated object, ...) bigger than N bytes aren't kept in memory
+// once the file has been read.  id3lib has no way of skipping them
+// while it parses, so each one is still read once; after that we find
+// where it sits in the file, note it in the tag's payload table and
+// empty the field.  anything that needs the bytes later --
+// dict_from_frame(), field_raw(), field_write(), update() -- looks
+// the field up in the table and reads them from the file.
+//
+// only id3_defer_payloads() adds to the table, and only for places it
+// has checked against the file, so nothing a file contains can send us
+// reading anywhere else.  the table records the file's size and
+// modification time, so that a file changed behind our back is
+// noticed instead of read from the wrong place.  a frame leaves the
+// table when it is deleted (see frame_drop()), and copies of frames
+// made for id3lib are filled in from it.
+
+#define PAYLOAD_CHECK       16
+
+static const deferred_payload* payload_find( ID3Object* self, ID3_Field* field )
+{
+    int i;
+
+    if ( self == NULL || self->deferred == NULL )
+	return NULL;
+    for ( i = 0; i < self->deferred->n; ++i )
+	if ( self->deferred->entry[i].field == field )
+	    return &self->deferred->entry[i];
+
+    return NULL;
+}
+
+// the size of a binary field's contents, wherever they are.
+
+static size_t binary_size( ID3Object* owner, ID3_Field* field )
+{
+    const deferred_payload* ref = payload_find( owner, field );
+
+    return ref ? ref->length : field->BinSize();
+}
+
+static void payload_table_clear( ID3Object* self )
+{
+    free( self->deferred );
+    self->deferred = NULL;
+}
+
+// delete one of a tag's frames, taking its payloads out of the table
+// so that a new frame that lands at the same address doesn't inherit
+// them.
+
+static void frame_drop( ID3Object* self, ID3_Frame* frame )
+{
+    payload_table* table = self->deferred;
+    int i, j = 0;
+
+    if ( table != NULL )
+    {
+	for ( i = 0; i < table->n; ++i )
+	    if ( table->entry[i].frame != frame )
+		table->entry[j++] = table->entry[i];
+	table->n = j;
+    }
+    delete frame;
+}
+
+static long long stat_mtime( const struct stat* st )
+{
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// open the file a tag's payloads were left in, making sure it hasn't
+// changed.  returns -1 with errno set if it can't be used.
+
+static int payload_open( ID3Object* self )
+{
+    struct stat st;
+    int fd, err;
+
+    fd = open( id3_filename( self ), O_RDONLY );
+    if ( fd < 0 )
+	return -1;
+    if ( fstat( fd, &st ) < 0 )
+    {
+	err = errno;
+	close( fd );
+	errno = err;
+	return -1;
+    }
+    if ( (unsigned long long)st.st_size != self->deferred->filesize ||
+	 stat_mtime( &st ) != self->deferred->mtime )
+    {
+	close( fd );
+	errno = ESTALE;
+	return -1;
+    }
+
+    return fd;
+}
+
+static int payload_read( ID3Object* self, const deferred_payload* ref, void* buf )
+{
+    size_t done = 0;
+    ssize_t n;
+    int fd, err;
+
+    fd = payload_open( self );
+    if ( fd < 0 )
+	return -1;
+
+    while ( done < ref->length )
+    {
+	n = pread( fd, (char*)buf + done, ref->length - done, ref->offset + done );
+	if ( n <= 0 )
+	{
+	    err = n < 0 ? errno : EIO;
+	    close( fd );
+	    errno = err;
+	    return -1;
+	}
+	done += n;
+    }
+    close( fd );
+
+    return 0;
+}
+
+// a payload read into a malloc()ed buffer, or NULL with errno set.
+
+static void* payload_fetch( ID3Object* self, const deferred_payload* ref )
+{
+    void* buf;
+    int err;
+
+    buf = malloc( ref->length ? ref->length : 1 );
+    if ( buf == NULL )
+    {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if ( payload_read( self, ref, buf ) < 0 )
+    {
+	err = errno;
+	free( buf );
+	errno = err;
+	return NULL;
+    }
+
+    return buf;
+}
+
+// the digest of a payload, exactly as xxh64() with the given seed
+// would give over its bytes, but read from the file and fed in a
+// chunk at a time instead of all at once.  returns -1 with errno set
+// if it can't be read.
+
+#define PAYLOAD_CHUNK       (64 * 1024)
+
+static int payload_hash( ID3Object* self, const deferred_payload* ref,
+			 unsigned long long seed, unsigned long long* digest )
+{
+    xxh_state state;
+    char* buf;
+    size_t done = 0, want;
+    ssize_t n;
+    int fd, err;
+
+    fd = payload_open( self );
+    if ( fd < 0 )
+	return -1;
+    buf = (char*)malloc( PAYLOAD_CHUNK );
+    if ( buf == NULL )
+    {
+	close( fd );
+	errno = ENOMEM;
+	return -1;
+    }
+
+    xxh64_begin( &state, seed );
+    while ( done < ref->length )
+    {
+	want = ref->length - done < PAYLOAD_CHUNK ? ref->length - done : PAYLOAD_CHUNK;
+	n = pread( fd, buf, want, ref->offset + done );
+	if ( n <= 0 )
+	{
+	    err = n < 0 ? errno : EIO;
+	    free( buf );
+	    close( fd );
+	    errno = err;
+	    return -1;
+	}
+	xxh64_feed( &state, buf, n );
+	done += n;
+    }
+    free( buf );
+    close( fd );
+
+    *digest = xxh64_end( &state );
+    return 0;
+}
+
+// fill in the payloads of one of our frames that were left in the
+// file, in dest, a copy of it made for id3lib.  returns -1 with errno
+// set if one can't be read.
+
+static int frame_load_payloads( ID3Object* self, ID3_Frame* frame, ID3_Frame* dest )
+{
+    const deferred_payload* ref;
+    ID3_Field* field;
+    void* buf;
+    int i;
+
+    for ( i = 0; self->deferred != NULL && i < self->deferred->n; ++i )
+    {
+	ref = &self->deferred->entry[i];
+	if ( ref->frame != frame || (field = dest->GetField( ref->field->GetID() )) == NULL )
+	    continue;
+	if ( (buf = payload_fetch( self, ref )) == NULL )
+	    return -1;
+	field->Set( (const uchar*)buf, ref->length );
+	free( buf );
+    }
+
+    return 0;
+}
+
+// put all of a tag's payloads back into their own fields, ready for
+// id3lib to write out, and empty the table.  returns -1 with errno set
+// if one can't be read; the ones loaded up to then leave the table.
+
+static int id3_load_payloads( ID3Object* self )
+{
+    payload_table* table = self->deferred;
+    void* buf = NULL;
+    int i, err;
+
+    if ( table == NULL )
+	return 0;
+
+    for ( i = 0; i < table->n; ++i )
+    {
+	if ( (buf = payload_fetch( self, &table->entry[i] )) == NULL )
+	    break;
+	table->entry[i].field->Set( (const uchar*)buf, table->entry[i].length );
+	free( buf );
+    }
+
+    if ( i < table->n )
+    {
+	err = errno;
+	memmove( table->entry, table->entry + i, (table->n - i) * sizeof( table->entry[0] ) );
+	table->n -= i;
+	errno = err;
+	return -1;
+    }
+
+    payload_table_clear( self );
+    return 0;
+}
+
+static ID3_Field* big_binary_field( ID3_Frame* frame, unsigned long limit )
+{
+    ID3_Field* field;
+
+    ID3_Frame::Iterator* fiter = frame->CreateIterator();
+    while ( (field = fiter->GetNext()) )
+	if ( field->GetType() == ID3FTY_BINARY && field->BinSize() > limit )
+	    break;
+    delete fiter;
+
+    return field;
+}
+
+static unsigned long read_syncsafe( const unsigned char* p )
+{
+    return ((unsigned long)(p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) |
+	((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+// find the big payloads of a freshly linked tag in its file and leave
+// them there.  we walk the ID3v2 frame headers with a pread() apiece,
+// and pair each big frame with the next of our frames with the same
+// ID and a big binary field.  the binary field is always the last
+// thing in such a frame, which gives its offset, and the ends of the
+// payload are compared against the file to be sure.  tags the walk
+// can't map onto the file byte for byte (ID3v2.2, unsynchronised,
+// compressed or encrypted frames) are left alone.  runs without the
+// interpreter lock.
+
+static void id3_defer_payloads( ID3Object* self )
+{
+    unsigned char hdr[ID3V2_HEADER_SIZE];
+    unsigned char check[2 * PAYLOAD_CHECK];
+    const char* filename = self->tag->GetFileName();
+    const char* id;
+    payload_table* table;
+    deferred_payload* ref;
+    ID3_Field* field;
+    struct stat st;
+    unsigned long long pos, end, body, size, off;
+    size_t len;
+    int fd, i, k, nbig = 0, next = 0;
+
+    if ( self->maxbinary == 0 || !(self->versions & ID3TT_ID3V2) ||
+	 filename == NULL || filename[0] == 0 || self->deferred != NULL )
+	return;
+
+    for ( i = 0; i < self->size; ++i )
+	if ( big_binary_field( self->frames[i], self->maxbinary ) )
+	    ++nbig;
+    if ( nbig == 0 )
+	return;
+
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+	return;
+    if ( fstat( fd, &st ) < 0 || pread( fd, hdr, sizeof( hdr ), 0 ) != sizeof( hdr ) ||
+	 (end = id3v2_tag_size( hdr )) == 0 || hdr[3] < 3 || (hdr[5] & 0x80) )
+    {
+	close( fd );
+	return;
+    }
+    if ( hdr[3] == 4 && (hdr[5] & 0x10) )
+	end -= ID3V2_HEADER_SIZE;
+    
+    pos = ID3V2_HEADER_SIZE;
+    if ( hdr[5] & 0x40 )
+    {
+	// extended header; in v2.3 its size doesn't count itself.
+	if ( pread( fd, check, 4, pos ) != 4 )
+	{
+	    close( fd );
+	    return;
+	}
+	pos += hdr[3] == 4 ? read_syncsafe( check ) : read_be32( check ) + 4;
+    }
+
+    table = (payload_table*)malloc( sizeof( *table ) + (nbig - 1) * sizeof( table->entry[0] ) );
+    if ( table != NULL )
+    {
+	table->filesize = st.st_size;
+	table->mtime = stat_mtime( &st );
+	table->n = 0;
+    }
+    
+    while ( table != NULL && next < self->size && pos + ID3V2_HEADER_SIZE <= end &&
+	    pread( fd, check, ID3V2_HEADER_SIZE, pos ) == ID3V2_HEADER_SIZE && check[0] != 0 )
+    {
+	size = hdr[3] == 4 ? read_syncsafe( check + 4 ) : read_be32( check + 4 );
+	body = pos + ID3V2_HEADER_SIZE;
+	pos = body + size;
+
+	if ( size <= self->maxbinary || pos > end )
+	    continue;
+	if ( hdr[3] == 3 ? (check[9] & 0xc0) : (check[9] & 0x0e) )
+	    continue;
+
+	field = NULL;
+	for ( i = next; i < self->size; ++i )
+	{
+	    id = self->frames[i]->GetTextID();
+	    if ( id != NULL && memcmp( id, check, 4 ) == 0 &&
+		 (field = big_binary_field( self->frames[i], self->maxbinary )) != NULL )
+		break;
+	}
+	if ( field == NULL )
+	    continue;
+	next = i + 1;
+
+	len = field->BinSize();
+	if ( len > size )
+	    continue;
+	off = body + size - len;
+
+	k = len < PAYLOAD_CHECK ? len : PAYLOAD_CHECK;
+	if ( pread( fd, check, k, off ) != k ||
+	     pread( fd, check + k, k, off + len - k ) != k ||
+	     memcmp( check, field->GetRawBinary(), k ) != 0 ||
+	     memcmp( check + k, field->GetRawBinary() + len - k, k ) != 0 )
+	    continue;
+
+	ref = &table->entry[table->n++];
+	ref->frame = self->frames[next - 1];
+	ref->field = field;
+	ref->offset = off;
+	ref->length = len;
+	field->Clear();
+    }
+
+    if ( table != NULL && table->n == 0 )
+    {
+	free( table );
+	table = NULL;
+    }
+    self->deferred = table;
+    close( fd );
+}
+
+/////////////////////
+//
+//   writing payloads straight to files
+//
+/////////////////////
+
+#define COPY_CHUNK          (1 << 30)
+
+static int write_all( int fd, const void* data, size_t len )
+{
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+	n = write( fd, data, len );
+	if ( n < 0 )
+	{
+	    if ( errno == EINTR )
+		continue;
+	    return -1;
+	}
+	data = (const char*)data + n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+// copy len bytes starting at offset in one file to the current
+// position of another, inside the kernel with sendfile() where the
+// output allows it, and through a small buffer where it doesn't.
+// returns -1 with errno set on failure.
+
+static int copy_region( int infd, unsigned long long offset, unsigned long long len, int outfd )
+{
+    char buf[65536];
+    off_t off = offset;
+    ssize_t n = 0;
+
+    while ( len > 0 )
+    {
+	n = sendfile( outfd, infd, &off, len < COPY_CHUNK ? len : COPY_CHUNK );
+	if ( n > 0 )
+	    len -= n;
+	else if ( n < 0 && errno == EINTR )
+	    continue;
+	else
+	    break;
+    }
+
+    if ( len > 0 && n < 0 && (errno == EINVAL || errno == ENOSYS) )
+	while ( len > 0 )
+	{
+	    n = pread( infd, buf, len < sizeof( buf ) ? len : sizeof( buf ), off );
+	    if ( n <= 0 || write_all( outfd, buf, n ) < 0 )
+		break;
+	    off += n;
+	    len -= n;
+	}
+
+    if ( len > 0 )
+    {
+	if ( n == 0 )
+	    errno = EIO;
+	return -1;
+    }
+
+    return 0;
+}
+
+static ID3_Field* binary_field( ID3_Frame* frame )
 {
-    return strcmp( (char*)a,
-                   ((magic_attribute*)b)->name );
+    ID3_Field* field;
+
+    ID3_Frame::Iterator* fiter = frame->CreateIterator();
+    while ( (field = fiter->GetNext()) )
+	if ( field->GetType() == ID3FTY_BINARY )
+	    break;
+    delete fiter;
+
+    return field;
 }
 
-static PyObject* id3_getattr( ID3Object* self, char* attrname )
+// write a binary field of owner's to fd, from memory or, for a
+// payload left in the file, from the file.  owner may be NULL for a
+// frame that belongs to no tag.  no Python involved.
+
+static int field_write( ID3Object* owner, ID3_Field* field, int fd )
 {
-    PyObject* result = NULL;
-    magic_attribute* p;
-    int i, n;
+    const deferred_payload* ref;
+    int src, result, err;
 
-    if ( strcmp( attrname, "__members__" ) == 0 )
-    {
-        static PyObject* memberlist = NULL;
-        PyObject* temp;
+    ref = payload_find( owner, field );
+    if ( ref == NULL )
+	return write_all( fd, field->GetRawBinary(), field->BinSize() );
 
-        if ( memberlist == NULL )
-        {
-            // build the memberlist once, and hold on to it.
-            
-            memberlist = PyList_New( 0 );
-            for ( i = 0; i < magic_attribute_table_size; ++i )
-                PyList_Append( memberlist, PyString_FromString( magic_attribute_table[i].name ) );
-            PyList_Append( memberlist, PyString_FromString( "track" ) );
-        }
+    src = payload_open( owner );
+    if ( src < 0 )
+	return -1;
+    result = copy_region( src, ref->offset, ref->length, fd );
+    err = errno;
+    close( src );
+    errno = err;
 
-        // make a copy of the memberlist to return
-        
-        n = PyList_Size( memberlist );
-        result = PyList_New( n );
-        for ( i = 0; i < n; ++i )
-        {
-            temp = PyList_GET_ITEM( memberlist, i );
-            Py_INCREF( temp );
-            PyList_SET_ITEM( result, i, temp );
-        }
-            
-        return result;
-    }
-    
-    if ( (p = (magic_attribute*)bsearch( attrname,
-					 magic_attribute_table,
-					 magic_attribute_table_size,
-					 sizeof( magic_attribute ),
-					 magic_attribute_compare )) )
-    {
-        ID3_Frame* frame;
-	const char* str;
-	char* slash;
-        ID3_Field* fld;
-	int i;
+    return result;
+}
 
-	frame = NULL;
-	for ( i = 0; i < self->size; ++i )
-	    if ( self->frames[i]->GetID() == p->fid )
-	    {
-		frame = self->frames[i];
-		break;
-	    }
+// tag.extract( index, dest ) writes the binary data of frame index --
+// a picture's image, say -- to dest, which is a filename or an open
+// file descriptor (or anything with a fileno() method), without
+// making a Python string of it.  the writing happens with the
+// interpreter lock released.  returns the number of bytes written.
 
-        if ( frame == NULL )
-        {
-	    PyErr_Format( PyExc_AttributeError, "tag has no '%s' frame", attrname );
-	    result = NULL;
-	    goto done;
-        }
-        
-        switch( p->type )
-        {
-          case PYFD_Text:
-            fld = frame->GetField( ID3FN_TEXT );
-            n = fld->Size();
-            result = PyString_FromStringAndSize( fld->GetRawText(), n );
-            break;
+static PyObject* id3_extract( ID3Object* self, PyObject* args )
+{
+    PyObject* dest;
+    ID3_Field* field;
+    const char* path = NULL;
+    unsigned long long len;
+    int index, fd = -1;
+    int result, err;
 
-          case PYFD_URL:
-            fld = frame->GetField( ID3FN_URL );
-            n = fld->Size();
-            result = PyString_FromStringAndSize( fld->GetRawText(), n );
-            break;
-	    
-          case PYFD_Year:
-	    result = PyInt_FromLong( atoi( frame->GetField( ID3FN_TEXT )->GetRawText() ) );
-	    break;
+    if ( !PyArg_ParseTuple( args, "iO:extract", &index, &dest ) )
+	return NULL;
 
-          case PYFD_Tracknum:
-            fld = frame->GetField( ID3FN_TEXT );
-            str = fld->GetRawText();
-            
-            if ( (slash = strchr( str, '/' )) != NULL )
-                result = Py_BuildValue( "ii", atoi( str ), atoi( slash+1 ) );
-            else
-                result = Py_BuildValue( "(i)", atoi( str ) );
-            break;
-        }
+    // dest's fileno() is Python code, which can change the tag or
+    // hand it to another thread, so it runs before we look at it.
+    if ( PyString_Check( dest ) )
+	path = PyString_AS_STRING( dest );
+    else if ( (fd = PyObject_AsFileDescriptor( dest )) < 0 )
+	return NULL;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( index < 0 )
+	index += self->size;
+    if ( index < 0 || index >= self->size )
+    {
+	PyErr_SetString( PyExc_IndexError, "extract index out of range" );
+	return NULL;
     }
-    else
-        result = Py_FindMethod( id3_methods, (PyObject*)self, attrname );
 
-done:
-    return result;
+    field = binary_field( self->frames[index] );
+    if ( field == NULL )
+    {
+	PyErr_SetString( ID3Error, "frame has no binary data" );
+	return NULL;
+    }
+    len = binary_size( self, field );
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    if ( path != NULL )
+	fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    result = fd < 0 ? -1 : field_write( self, field, fd );
+    err = errno;
+    if ( path != NULL && fd >= 0 && close( fd ) < 0 && result == 0 )
+    {
+	result = -1;
+	err = errno;
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if ( result < 0 )
+    {
+	errno = err;
+	if ( path != NULL )
+	    return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)path );
+	return PyErr_SetFromErrno( PyExc_IOError );
+    }
+
+    return PyLong_FromUnsignedLongLong( len );
 }
 
-static int id3_setattr( ID3Object* self, char* attrname, PyObject* val )
+// pyid3lib.extract_pictures( filenames, directory, threads=0 ) writes
+// every picture in every file into directory, as "N-K.ext": the Kth
+// picture of the Nth file, with an extension that goes by its
+// mimetype.  like audio_digests(), the work is spread over native
+// threads with the interpreter lock released, so no picture ever
+// becomes a Python string.  returns, for each file, a list of the
+// paths written, or None if the file couldn't be read or a picture
+// couldn't be written; in that case none of its pictures are left in
+// the directory.
+
+typedef struct
 {
-    ID3_Frame* newframe;
-    ID3_Field* field;
-    magic_attribute* p;
+    const char** names;
+    const char* directory;
+    char** written;         // per file, the paths written, each null-terminated, then an empty one
+    long n;
+    long next;
+    pthread_mutex_t mutex;
+} picture_batch;
+
+static const char* picture_extension( const char* mimetype )
+{
+    static const char* types[][2] = {
+	{ "image/jpeg", "jpg" }, { "image/jpg", "jpg" }, { "jpg", "jpg" },
+	{ "image/png", "png" }, { "png", "png" },
+	{ "image/gif", "gif" }, { "gif", "gif" },
+    };
+    unsigned i;
+
+    if ( mimetype != NULL )
+	for ( i = 0; i < sizeof( types ) / sizeof( types[0] ); ++i )
+	    if ( strcasecmp( mimetype, types[i][0] ) == 0 )
+		return types[i][1];
+
+    return "bin";
+}
+
+static char* extract_tag_pictures( ID3_Tag* tag, const char* directory, long n )
+{
+    char path[4096];
+    char* list;
+    char* grown;
+    const char* p;
+    size_t used = 0, len;
+    ID3_Field* mimetype;
+    ID3_Frame* frame;
+    int fd, k = 0, failed = 0;
+
+    list = (char*)malloc( 1 );
+    if ( list == NULL )
+	return NULL;
 
-    if ( (p = (magic_attribute*)bsearch( attrname,
-					 magic_attribute_table,
-					 magic_attribute_table_size,
-					 sizeof( magic_attribute ),
-					 magic_attribute_compare )) )
+    ID3_Tag::Iterator* titer = tag->CreateIterator();
+    while ( !failed && (frame = titer->GetNext()) )
     {
-	int i, j;
-	
-	// for "del x.attr" or "x.attr = None", just delete all frames
-	// of the appropriate type.
-        if ( val == NULL || val == Py_None )
-        {
-	    j = 0;
-	    for ( i = 0; i < self->size; ++i )
-	    {
-		if ( self->frames[i]->GetID() == p->fid )
-		    delete self->frames[i];
-		else
-		    self->frames[j++] = self->frames[i];
-	    }
-	    self->size = j;
-	    
-            return 0;
-        }
+	if ( frame->GetID() != ID3FID_PICTURE || binary_field( frame ) == NULL )
+	    continue;
 
-	newframe = NULL;
+	mimetype = frame->GetField( ID3FN_MIMETYPE );
+	len = snprintf( path, sizeof( path ), "%s/%ld-%d.%s", directory, n, k++,
+			picture_extension( mimetype ? mimetype->GetRawText() : NULL ) );
+	grown = len < sizeof( path ) ? (char*)realloc( list, used + len + 2 ) : NULL;
+	if ( grown == NULL )
+	{
+	    failed = 1;
+	    continue;
+	}
+	list = grown;
 	
-	switch( p->type )
+	fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+	if ( fd < 0 )
 	{
-	  case PYFD_Text:
-	    if ( !PyString_Check( val ) )
-	    {
-		PyErr_Format( ID3Error, "'%s' attribute must be string", attrname );
-		return -1;
-	    }
-		
-	    newframe = new ID3_Frame( p->fid );
-	    newframe->GetField( ID3FN_TEXT )->Set( PyString_AsString( val ) );
-	    break;
-		
-	  case PYFD_URL:
-	    if ( !PyString_Check( val ) )
-	    {
-		PyErr_Format( ID3Error, "'%s' attribute must be string", attrname );
-		return -1;
-	    }
+	    failed = 1;
+	    continue;
+	}
+	if ( field_write( NULL, binary_field( frame ), fd ) < 0 )
+	    failed = 1;
+	if ( close( fd ) < 0 )
+	    failed = 1;
 
-	    newframe = new ID3_Frame( p->fid );
-	    newframe->GetField( ID3FN_URL )->Set( PyString_AsString( val ) );
-	    break;
+	memcpy( list + used, path, len + 1 );
+	used += len + 1;
+    }
+    delete titer;
+    list[used] = 0;
 
-	  case PYFD_Year:
-	    newframe = new ID3_Frame( p->fid );
-	    field = newframe->GetField( ID3FN_TEXT );
-		
-	    if ( PyString_Check( val ) )
-		field->Set( PyString_AsString( val ) );
-	    else if ( PyInt_Check( val ) )
-	    {
-		char buffer[20];
-		sprintf( buffer, "%04ld", PyInt_AsLong( val ) );
-		field->Set( buffer );
-	    }
-	    else
-	    {
-		delete newframe;
-		PyErr_Format( ID3Error, "'%s' attribute must be string or int", attrname );
-		return -1;
-	    }
-	    break;
+    // take back what was written before the failure, so the caller
+    // isn't left with some of the file's pictures and no list of them.
+    if ( failed )
+    {
+	for ( p = list; *p; p += strlen( p ) + 1 )
+	    unlink( p );
+	free( list );
+	return NULL;
+    }
 
-	  case PYFD_Tracknum:
-	    newframe = new ID3_Frame( p->fid );
-	    field = newframe->GetField( ID3FN_TEXT );
-		
-	    if ( PyString_Check( val ) )
-		field->Set( PyString_AsString( val ) );
-	    else if ( PyInt_Check( val ) )
-	    {
-		char buffer[20];
-		sprintf( buffer, "%ld", PyInt_AsLong( val ) );
-		field->Set( buffer );
-	    }
-	    else if ( PyTuple_Check( val ) )
-	    {
-		if ( PyTuple_Size( val ) == 1 &&
-		     PyInt_Check( PyTuple_GetItem( val, 0 ) ) )
-		{
-		    char buffer[20];
-		    sprintf( buffer, "%ld", PyInt_AsLong( PyTuple_GetItem( val, 0 ) ) );
-		    field->Set( buffer );
-		}
-		else if ( PyTuple_Size( val ) == 2 &&
-			  PyInt_Check( PyTuple_GetItem( val, 0 ) ) &&
-			  PyInt_Check( PyTuple_GetItem( val, 1 ) ) )
-		{
-		    char buffer[40];
-		    sprintf( buffer, "%ld/%ld",
-			     PyInt_AsLong( PyTuple_GetItem( val, 0 ) ),
-			     PyInt_AsLong( PyTuple_GetItem( val, 1 ) ) );
-		    field->Set( buffer );
-		}
-		else
-		{
-		    delete newframe;
-		    newframe = NULL;
-		}
-	    }
-	    else
-	    {
-		delete newframe;
-		newframe = NULL;
-	    }
+    return list;
+}
 
-	    if ( newframe == NULL )
-	    {
-		PyErr_Format( ID3Error, "'%s' attribute must be string or int or (int,) or (int,int)", attrname );
-		return -1;
-	    }
+static void* picture_batch_worker( void* arg )
+{
+    picture_batch* batch = (picture_batch*)arg;
+    ID3_Tag tag;
+    long i;
+
+    for ( ;; )
+    {
+	pthread_mutex_lock( &batch->mutex );
+	i = batch->next++;
+	pthread_mutex_unlock( &batch->mutex );
+	if ( i >= batch->n )
 	    break;
+
+	batch->written[i] = NULL;
+	if ( access( batch->names[i], R_OK ) < 0 )
+	    continue;
+
+	tag.Clear();
+	tag.Link( batch->names[i], ID3TT_ID3V2 );
+	batch->written[i] = extract_tag_pictures( &tag, batch->directory, i );
+    }
+    tag.Clear();
+
+    return NULL;
+}
+
+static PyObject* extract_pictures( PyObject* self, PyObject* args, PyObject* kwds )
+{
+    static char* kwlist[] = { "filenames", "directory", "threads", NULL };
+    PyObject* seq;
+    PyObject* list;
+    PyObject* result = NULL;
+    PyObject* item;
+    PyObject* path;
+    pthread_t* threads;
+    picture_batch batch;
+    const char* p;
+    int nthreads = 0;
+    int i, started;
+
+    if ( !PyArg_ParseTupleAndKeywords( args, kwds, "Os|i:extract_pictures", kwlist,
+				       &seq, &batch.directory, &nthreads ) )
+	return NULL;
+    if ( nthreads < 0 || nthreads > SCAN_MAX_THREADS )
+    {
+	PyErr_Format( PyExc_ValueError, "extract_pictures() threads must be between 0 and %d",
+		      SCAN_MAX_THREADS );
+	return NULL;
+    }
+
+    list = PySequence_List( seq );
+    if ( list == NULL )
+	return NULL;
+
+    batch.n = PyList_GET_SIZE( list );
+    batch.next = 0;
+    for ( i = 0; i < batch.n; ++i )
+	if ( !PyString_Check( PyList_GET_ITEM( list, i ) ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "extract_pictures() requires a sequence of filenames" );
+	    Py_DECREF( list );
+	    return NULL;
 	}
 
-	// if we reach this point, newframe should have a good frame in it.
-	// remove all old instances of this type and attach the new frame.
-        
-	j = 0;
-	for ( i = 0; i < self->size; ++i )
+    batch.names = new const char* [batch.n + 1];
+    batch.written = new char* [batch.n + 1];
+    for ( i = 0; i < batch.n; ++i )
+	batch.names[i] = PyString_AS_STRING( PyList_GET_ITEM( list, i ) );
+    pthread_mutex_init( &batch.mutex, NULL );
+    threads = new pthread_t [nthreads + 1];
+
+    Py_BEGIN_ALLOW_THREADS
+    for ( started = 0; started < nthreads; ++started )
+	if ( pthread_create( &threads[started], NULL, picture_batch_worker, &batch ) != 0 )
+	    break;
+    
+    picture_batch_worker( &batch );
+    
+    for ( i = 0; i < started; ++i )
+	pthread_join( threads[i], NULL );
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New( batch.n );
+    for ( i = 0; result != NULL && i < batch.n; ++i )
+    {
+	if ( batch.written[i] == NULL )
 	{
-	    if ( self->frames[i]->GetID() == p->fid )
-		delete self->frames[i];
-	    else
-		self->frames[j++] = self->frames[i];
+	    item = Py_None;
+	    Py_INCREF( item );
 	}
-	self->size = j;
-
-	if ( self->size + 1 > self->alloc )
+	else
 	{
-	    self->alloc += 8;
-	    self->frames = (ID3_Frame**)realloc( self->frames, self->alloc * sizeof( ID3_Frame* ) );
+	    item = PyList_New( 0 );
+	    for ( p = batch.written[i]; item != NULL && *p; p += strlen( p ) + 1 )
+	    {
+		path = PyString_FromString( p );
+		if ( path == NULL || PyList_Append( item, path ) < 0 )
+		    Py_CLEAR( item );
+		Py_XDECREF( path );
+	    }
 	}
+	if ( item == NULL )
+	    Py_CLEAR( result );
+	else
+	    PyList_SET_ITEM( result, i, item );
+    }
 
-	self->frames[self->size++] = newframe;
+    for ( i = 0; i < batch.n; ++i )
+	free( batch.written[i] );
+    pthread_mutex_destroy( &batch.mutex );
+    delete [] threads;
+    delete [] batch.names;
+    delete [] batch.written;
+    Py_DECREF( list );
 
-	return 0;
+    return result;
+}
+
+/////////////////////
+//
+//   sending a file with a different tag
+//
+/////////////////////
+
+// render the tag's frames as an ID3v2 tag, unpadded, into a malloc()ed
+// buffer.  id3lib renders from its own copies of the frames, which
+// come in the order they were added, so any payloads left in the file
+// are loaded into those, and our frames stay as they are.  returns -1
+// with errno set on failure.  no Python involved.
+
+static int id3_render( ID3Object* self, unsigned char** out, size_t* len )
+{
+    ID3_Tag tag;
+    ID3_Frame* frame;
+    int i, result = 0;
+
+    *out = NULL;
+    *len = 0;
+    
+    tag.SetPadding( false );
+    for ( i = 0; i < self->size; ++i )
+	tag.AddFrame( self->frames[i] );
+
+    ID3_Tag::Iterator* titer = tag.CreateIterator();
+    for ( i = 0; result == 0 && (frame = titer->GetNext()); ++i )
+	result = frame_load_payloads( self, self->frames[i], frame );
+    delete titer;
+
+    if ( result == 0 )
+    {
+	*out = (unsigned char*)malloc( tag.Size() + 1 );
+	if ( *out == NULL )
+	{
+	    errno = ENOMEM;
+	    result = -1;
+	}
+	else
+	    *len = tag.Render( *out, ID3TT_ID3V2 );
     }
     
-    PyErr_Format( PyExc_AttributeError, "'%s' object has no attribute '%s'",
-		  ID3Type.tp_name, attrname );
-    return -1;
+    return result;
+}
+
+// tag.render() returns the tag as the bytes of an ID3v2 tag, e.g. to
+// hand to stream_file() many times over.
+
+static PyObject* id3_render_tag( ID3Object* self )
+{
+    PyObject* result;
+    unsigned char* data;
+    size_t len;
+    int rendered;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    rendered = id3_render( self, &data, &len );
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if ( rendered < 0 )
+	return PyErr_SetFromErrno( PyExc_IOError );
     
+    result = PyString_FromStringAndSize( (char*)data, len );
+    free( data );
+
+    return result;
+}
+
+// write the tag, then the audio of source -- everything between its
+// ID3v2 tag at the front and its ID3v1 tag at the end -- to fd.  the
+// audio goes through copy_region(), so with sendfile() it never
+// enters user space.  we find the tags' extents from their headers
+// rather than by having id3lib parse the whole tag just to learn its
+// size.
+
+static int send_with_tag( const char* source, const void* tag, size_t taglen, int fd,
+			  unsigned long long* total )
+{
+    struct stat st;
+    unsigned long long start, end;
+    int src, result, err;
+
+    src = open( source, O_RDONLY );
+    if ( src < 0 )
+	return -1;
+    if ( fstat( src, &st ) < 0 )
+    {
+	err = errno;
+	close( src );
+	errno = err;
+	return -1;
+    }
+
+    audio_bounds( src, st.st_size, &start, &end );
+
+    result = write_all( fd, tag, taglen );
+    if ( result == 0 )
+	result = copy_region( src, start, end - start, fd );
+    err = errno;
+    close( src );
+    errno = err;
+
+    *total = taglen + end - start;
+    return result;
 }
 
+// pyid3lib.stream_file( source, tag, dest ) writes source to dest (a
+// file descriptor, or anything with a fileno() method, such as a
+// socket) with its tags replaced by tag: a tag object, a string from
+// tag.render(), or None for no tag at all.  source itself is never
+// modified.  returns the number of bytes written.
+
+static PyObject* stream_file( PyObject* self, PyObject* args )
+{
+    const char* source;
+    PyObject* tagobj;
+    PyObject* dest;
+    ID3Object* id3obj = NULL;
+    unsigned char* rendered = NULL;
+    const void* data = NULL;
+    size_t len = 0;
+    unsigned long long total = 0;
+    int fd, result, err;
+
+    if ( !PyArg_ParseTuple( args, "sOO:stream_file", &source, &tagobj, &dest ) )
+	return NULL;
+
+    if ( PyString_Check( tagobj ) )
+    {
+	data = PyString_AS_STRING( tagobj );
+	len = PyString_GET_SIZE( tagobj );
+    }
+    else if ( PyObject_TypeCheck( tagobj, &ID3Type ) )
+	id3obj = (ID3Object*)tagobj;
+    else if ( tagobj != Py_None )
+    {
+	PyErr_SetString( PyExc_TypeError, "stream_file() tag must be a tag, a string or None" );
+	return NULL;
+    }
+
+    // dest's fileno() is Python code, which can hand the tag to
+    // another thread; only check it's free once that has run.
+    fd = PyObject_AsFileDescriptor( dest );
+    if ( fd < 0 )
+	return NULL;
+    if ( id3obj != NULL )
+	CHECK_NOT_BUSY( id3obj, NULL );
+
+    if ( id3obj != NULL )
+	id3obj->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    result = 0;
+    if ( id3obj != NULL )
+    {
+	result = id3_render( id3obj, &rendered, &len );
+	data = rendered;
+    }
+    if ( result == 0 )
+	result = send_with_tag( source, data, len, fd, &total );
+    err = errno;
+    free( rendered );
+    Py_END_ALLOW_THREADS
+    if ( id3obj != NULL )
+	id3obj->busy = 0;
+
+    if ( result < 0 )
+    {
+	errno = err;
+	return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)source );
+    }
 
+    return PyLong_FromUnsignedLongLong( total );
+}
 
 /////////////////////
 //
@@ -1234,55 +5312,291 @@ static int id3_setattr( ID3Object* self, char* attrname, PyObject* val )
 //
 /////////////////////
 
-static PyObject* id3_new( PyObject* self, PyObject* args )
-{
-    ID3Object* id3obj;
-    char* filename;
-
-    if ( !PyArg_ParseTuple( args, "s:tag", &filename ) )
-        return NULL;
+// link the tag object to the named file and pull its frames out
+// into our own array.  any frames the object was holding before are
+// thrown away, but the ID3_Tag and the array itself are reused.
+//
+// this only touches id3lib and our own memory, never Python, so it
+// may be run without the interpreter lock.  returns -1 if there wasn't
+// memory to keep every frame; the tag is then left empty and unlinked,
+// so a later update() can't write a shortened tag over the file.
 
-    id3obj = PyObject_NEW( ID3Object, &ID3Type );
-    id3obj->tag = new ID3_Tag( filename );
-    if ( id3obj->tag == NULL )
+static int id3_read_file( ID3Object* self, const char* filename, const load_options* opts,
+			  phase_times* times )
+{
+    cache_hint hint;
+    stat_block* stats = stat_thread_block();
+    unsigned long long start = stat_clock();
+    unsigned long long linked;
+    size_t bytes;
+    int i, failed = 0;
+    
+    for ( i = 0; i < self->size; ++i )
+	delete self->frames[i];
+    self->size = 0;
+    self->dirty = 0;
+    payload_table_clear( self );
+    digest_cache_clear( self );
+    free( self->stream );
+    self->stream = NULL;
+    free( self->filename );
+    self->filename = NULL;
+    self->versions = opts->versions;
+    self->ondisk = 0;
+    self->maxbinary = opts->maxbinary;
+
+    if ( opts->nocache )
+	cache_hint_begin( &hint, filename );
+    
+    self->tag->Clear();
+    if ( opts->versions == ID3TT_ID3V1 )
     {
-        PyErr_SetString( ID3Error, "tag constructor failed" );
-        
-        PyObject_Del( id3obj );
-        return NULL;
+	// an ID3v1 tag makes at most seven frames.
+	self->filename = strdup( filename );
+	if ( id3_reserve( self, 7 ) < 0 )
+	    failed = 1;
+	bytes = failed ? 0 : id3v1_read( self, filename );
+    }
+    else
+    {
+	self->tag->Link( filename, opts->versions );
+	bytes = self->tag->GetPrependedBytes() + self->tag->GetAppendedBytes();
+	if ( self->tag->HasTagType( ID3TT_ID3V1 ) )
+	    self->ondisk |= ID3TT_ID3V1;
+	if ( self->tag->HasTagType( ID3TT_ID3V2 ) )
+	    self->ondisk |= ID3TT_ID3V2;
+	self->ondisk &= opts->versions;
     }
 
-    // separate all the frames from the object and keep them in an array
+    linked = stat_clock();
+    stat_bump( &stats->count[STAT_FILES_OPENED], 1 );
+    stat_bump( &stats->count[STAT_TAG_BYTES], bytes );
+
+    if ( opts->nocache )
+	cache_hint_end( &hint );
+
+    // separate all the frames from the object and keep them in an
+    // array.  RemoveFrame() hands ownership of the frame back to us,
+    // so we can keep it as-is instead of making a copy.
 
-    id3obj->alloc = id3obj->tag->NumFrames();
-    id3obj->frames = (ID3_Frame**)malloc( id3obj->alloc * sizeof( ID3_Frame* ) );
-    id3obj->size = 0;
-    ID3_Tag::Iterator* titer = id3obj->tag->CreateIterator();
+    id3_reserve( self, self->tag->NumFrames() );
+    
+    ID3_Tag::Iterator* titer = self->tag->CreateIterator();
     ID3_Frame* frame;
     
     while ( (frame = titer->GetNext()) )
     {
+	self->tag->RemoveFrame( frame );
+
 	// unfortunately, we have to discard any frames that
 	// id3lib doesn't recognize, due to a bug in its handling
 	// of them.  hopefully this will change.
-	if ( frame->GetID() != ID3FID_NOFRAME )
+	if ( frame->GetID() == ID3FID_NOFRAME )
+	    delete frame;
+	else if ( id3_reserve( self, self->size + 1 ) == 0 )
+	    self->frames[self->size++] = frame;
+	else
 	{
-	    id3obj->frames[id3obj->size] = new ID3_Frame( *frame );
-	    ++id3obj->size;
+	    delete frame;
+	    failed = 1;
 	}
-	id3obj->tag->RemoveFrame( frame );
     }
+    delete titer;
+
+    if ( failed )
+    {
+	for ( i = 0; i < self->size; ++i )
+	    delete self->frames[i];
+	self->size = 0;
+	self->tag->Clear();
+	free( self->filename );
+	self->filename = NULL;
+    }
+
+    // the digests are worked out while every payload is still in
+    // memory, rather than read back from the file once it's deferred.
+    if ( opts->digests )
+	id3_compute_digests( self );
+    id3_defer_payloads( self );
+
+    memset( times, 0, sizeof( *times ) );
+    times->ns[PHASE_LINK] = linked - start;
+    times->ns[PHASE_EXTRACT] = stat_clock() - linked;
+    stat_record_phase( stats, PHASE_LINK, times->ns[PHASE_LINK] );
+    stat_record_phase( stats, PHASE_EXTRACT, times->ns[PHASE_EXTRACT] );
+    
+    stat_bump( &stats->count[STAT_FRAMES_LOADED], self->size );
+    stat_bump( &stats->count[STAT_PARSE_TIME], times->ns[PHASE_LINK] + times->ns[PHASE_EXTRACT] );
+
+    return failed ? -1 : 0;
+}
+
+// returns -1 with MemoryError set if the file's frames couldn't all
+// be kept.
+
+static int id3_load( ID3Object* self, const char* filename, const load_options* opts )
+{
+    phase_times times;
+    int result;
+    
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    result = id3_read_file( self, filename, opts, &times );
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if ( result < 0 )
+    {
+	PyErr_NoMemory();
+	return -1;
+    }
+
+    slow_hook_check( filename, &times, self );
+    return 0;
+}
+
+// a new tag object with an empty ID3_Tag, not linked to any file.
+
+static ID3Object* id3_alloc( void )
+{
+    ID3Object* id3obj;
+
+    id3obj = PyObject_NEW( ID3Object, &ID3Type );
+    if ( id3obj == NULL )
+	return NULL;
+    
+    id3obj->tag = tag_get();
+    if ( id3obj->tag == NULL )
+    {
+        PyErr_SetString( ID3Error, "tag constructor failed" );
+        
+        PyObject_Del( id3obj );
+        return NULL;
+    }
+
+    id3obj->busy = 0;
+    id3obj->dirty = 0;
+    id3obj->digests = NULL;
+    id3obj->stream = NULL;
+    id3obj->versions = ID3TT_ALL;
+    id3obj->ondisk = 0;
+    id3obj->filename = NULL;
+    id3obj->maxbinary = 0;
+    id3obj->deferred = NULL;
+    frame_array_get( id3obj );
+
+    return id3obj;
+}
+
+static ID3Object* id3_create( const char* filename, const load_options* opts )
+{
+    ID3Object* id3obj;
+
+    id3obj = id3_alloc();
+    if ( id3obj != NULL && id3_load( id3obj, filename, opts ) < 0 )
+	Py_CLEAR( id3obj );
+
+    return id3obj;
+}
+
+static PyObject* id3_new( PyObject* self, PyObject* args, PyObject* kwds )
+{
+    static char* kwlist[] = { "filename", "nocache", "versions", "maxbinary", NULL };
+    char* filename;
+    char* versionname = NULL;
+    load_options opts = { 0, (flags_t)ID3TT_ALL, 0, 0 };
+
+    if ( !PyArg_ParseTupleAndKeywords( args, kwds, "s|izk:tag", kwlist, &filename,
+				       &opts.nocache, &versionname, &opts.maxbinary ) )
+        return NULL;
+
+    if ( parse_versions( versionname, &opts.versions, "tag" ) < 0 )
+	return NULL;
+
+    return (PyObject*)id3_create( filename, &opts );
+}
+
+static PyObject* id3_reopen( ID3Object* self, PyObject* args, PyObject* kwds )
+{
+    static char* kwlist[] = { "filename", "nocache", "versions", "maxbinary", NULL };
+    char* filename;
+    char* versionname = NULL;
+    load_options opts = { 0, (flags_t)ID3TT_ALL, 0, 0 };
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    if ( !PyArg_ParseTupleAndKeywords( args, kwds, "s|izk:reopen", kwlist, &filename,
+				       &opts.nocache, &versionname, &opts.maxbinary ) )
+        return NULL;
+
+    if ( parse_versions( versionname, &opts.versions, "reopen" ) < 0 )
+	return NULL;
+
+    if ( id3_load( self, filename, &opts ) < 0 )
+	return NULL;
 
-    return (PyObject*) id3obj;
+    Py_INCREF( Py_None );
+    return Py_None;
 }
 
 static PyObject* id3_update( ID3Object* self )
 {
-    int i;
+    phase_times times;
+    unsigned long long start;
+    size_t before;
+    int i, loaded;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    // nothing to write if the frames haven't been touched and the
+    // file already has every kind of tag that would be written.  a
+    // file with only an ID3v1 tag still gets its ID3v2 one.  versions
+    // may hold other id3lib flags (ID3TT_ALL does), but only these two
+    // kinds are ever noted in ondisk.
+    if ( !self->dirty && self->ondisk == (self->versions & TAG_KINDS) )
+    {
+	Py_INCREF( Py_None );
+	return Py_None;
+    }
+
+    // id3lib renders the whole tag in memory, so any payloads that
+    // were left in the file have to be read back in first.  if one
+    // can't be, nothing is written.
+    
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    id3_link( self );
+    loaded = id3_load_payloads( self );
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if ( loaded < 0 )
+	return PyErr_SetFromErrnoWithFilename( PyExc_IOError, (char*)id3_filename( self ) );
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    start = stat_clock();
+    
     for ( i = 0; i < self->size; ++i )
 	self->tag->AddFrame( self->frames[i] );
+
+    // id3lib writes the new tag over the old one when it fits, and
+    // rewrites the whole file when it doesn't.  which one happened
+    // shows up as a change in the size of the tag at the front.
     
-    self->tag->Update();
+    before = self->tag->GetPrependedBytes();
+    self->tag->Update( self->versions );
+
+    if ( self->tag->GetPrependedBytes() == before )
+    {
+	STAT_ADD( STAT_UPDATES_IN_PLACE, 1 );
+	STAT_ADD( STAT_BYTES_WRITTEN, self->tag->GetPrependedBytes() + self->tag->GetAppendedBytes() );
+    }
+    else
+    {
+	STAT_ADD( STAT_UPDATES_REWRITTEN, 1 );
+	STAT_ADD( STAT_BYTES_WRITTEN, self->tag->GetFileSize() );
+    }
 
     ID3_Tag::Iterator* titer = self->tag->CreateIterator();
     ID3_Frame* frame;
@@ -1291,6 +5605,21 @@ static PyObject* id3_update( ID3Object* self )
     {
 	self->tag->RemoveFrame( frame );
     }
+    delete titer;
+
+    id3_defer_payloads( self );
+
+    memset( &times, 0, sizeof( times ) );
+    times.ns[PHASE_UPDATE] = stat_clock() - start;
+    stat_record_phase( stat_thread_block(), PHASE_UPDATE, times.ns[PHASE_UPDATE] );
+
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    self->dirty = 0;
+    self->ondisk = self->versions & TAG_KINDS;
+    digest_cache_clear( self );
+
+    slow_hook_check( self->tag->GetFileName(), &times, self );
 
     Py_INCREF( Py_None );
     return Py_None;
@@ -1302,13 +5631,51 @@ static void id3_dealloc( ID3Object* self )
     
     for ( i = 0; i < self->size; ++i )
 	delete self->frames[i];
-    free( self->frames );
+    payload_table_clear( self );
+    frame_array_put( self );
+    digest_cache_clear( self );
+    free( self->stream );
+    free( self->filename );
 
-    delete self->tag;
+    tag_put( self->tag );
 
     PyObject_Del( (PyObject*)self );
 }
 
+static PyObject* id3_get_dirty( ID3Object* self, void* closure )
+{
+    return PyBool_FromLong( self->dirty );
+}
+
+// the memory held by a tag object: the object itself, the ID3_Tag,
+// the frame array, and every frame along with its fields and their
+// contents.  id3lib's private bookkeeping inside each of those isn't
+// visible from here, so this is a lower bound, but the field data
+// (pictures especially) is what usually dominates.
+
+static PyObject* id3_sizeof( ID3Object* self )
+{
+    size_t total;
+    int i;
+
+    CHECK_NOT_BUSY( self, NULL );
+
+    total = sizeof( ID3Object ) + sizeof( ID3_Tag ) + self->alloc * sizeof( ID3_Frame* );
+    
+    for ( i = 0; i < self->size; ++i )
+    {
+	ID3_Frame::Iterator* fiter = self->frames[i]->CreateIterator();
+	ID3_Field* field;
+	
+	total += sizeof( ID3_Frame );
+	while ( (field = fiter->GetNext()) )
+	    total += sizeof( ID3_Field ) + field->BinSize();
+	delete fiter;
+    }
+
+    return PyInt_FromSize_t( total );
+}
+
 
 //////////////////////////
 //
@@ -1316,57 +5683,108 @@ static void id3_dealloc( ID3Object* self )
 //
 //////////////////////////
 
-static PyObject* query_frametype( PyObject* self, PyObject* args )
+// build the (id, description, field names) tuple for a frame ID the
+// first time somebody asks for it.  making the field list means
+// constructing a throwaway frame, which is too slow to do for every
+// frame ID at import time.
+
+static PyObject* query_frameid( ID3_FrameID fid )
 {
-    PyObject* result;
-    PyObject* obj;
+    PyObject* tuple;
+    
+    if ( frameid_info[fid] == NULL )
+    {
+	ID3_FrameInfo finfo;
+	
+	tuple = PyTuple_New( 3 );
+	if ( tuple == NULL )
+	    return NULL;
+	PyTuple_SET_ITEM( tuple, 0, PyInt_FromLong( fid ) );
+	PyTuple_SET_ITEM( tuple, 1, PyString_FromString( finfo.Description( fid ) ) );
+		
+	ID3_Frame* frame = new ID3_Frame( fid );
+	ID3_Frame::Iterator* fiter = frame->CreateIterator();
+	ID3_Field* field;
+
+	// overestimate the size.  "lyst" is a misnomer, it's
+	// actually a tuple.
+	PyObject* lyst;
+	lyst = PyTuple_New( frame->NumFields() );
+	int actual = 0;
+		
+	while( (field = fiter->GetNext()) )
+	{
+	    ID3_FieldID flid = field->GetID();
+	    if ( field_keys[flid] == NULL )
+		continue;
+
+	    Py_INCREF( field_keys[flid] );
+	    PyTuple_SET_ITEM( lyst, actual, field_keys[flid] );
+	    ++actual;
+	}
+	_PyTuple_Resize( &lyst, actual );
+
+	delete fiter;
+	delete frame;
+
+	PyTuple_SET_ITEM( tuple, 2, lyst );
+
+	frameid_info[fid] = tuple;
+    }
+
+    Py_INCREF( frameid_info[fid] );
+    return frameid_info[fid];
+}
+
+static PyObject* query_frametype( PyObject* self, PyObject* obj )
+{
+    ID3_FrameID fid;
     char* type;
     int i;
 
-    if ( !PyArg_ParseTuple( args, "O", &obj ) )
-	return NULL;
-
-    if ( !PyString_Check( obj ) )
+    if ( PyString_Check( obj ) )
     {
-	PyErr_SetString( ID3Error, "non-string as frame ID" );
-	return NULL;
-    }
+	type = PyString_AsString( obj );
     
-    type = PyString_AsString( obj );
-    
-    if ( strlen(type) != 4 )
-    {
-	PyErr_Format( ID3Error, "'%s' is not a legal frame ID", type );
-	Py_DECREF( obj );
-	return NULL;
-    }
-
-    for ( i = 0; i < 4; ++i )
-	if ( !(type[i] >= 'A' && type[i] <= 'Z') &&
-	     !(type[i] >= '0' && type[i] <= '9') )
+	if ( strlen(type) != 4 )
 	{
 	    PyErr_Format( ID3Error, "'%s' is not a legal frame ID", type );
-	    Py_DECREF( obj );
 	    return NULL;
 	}
 
-    result = PyDict_GetItem( frameid_lookup, obj );
-    Py_DECREF( obj );
-    if ( result == NULL )
+	for ( i = 0; i < 4; ++i )
+	    if ( !(type[i] >= 'A' && type[i] <= 'Z') &&
+		 !(type[i] >= '0' && type[i] <= '9') )
+	    {
+		PyErr_Format( ID3Error, "'%s' is not a legal frame ID", type );
+		return NULL;
+	    }
+    }
+    else if ( !PyInt_Check( obj ) )
     {
-	PyErr_Format( ID3Error, "frame ID '%s' is not supported by id3lib", type );
+	PyErr_SetString( ID3Error, "frame ID must be string or int" );
 	return NULL;
     }
 
-    Py_INCREF( result );
-    return result;
+    if ( frameid_from_object( obj, &fid ) < 0 )
+	return NULL;
+
+    return query_frameid( fid );
 }
 
     
 
 static PyMethodDef module_methods[] = {
-    { "tag", id3_new, METH_VARARGS },
-    { "query", query_frametype, METH_VARARGS },
+    { "tag", (PyCFunction)id3_new, METH_VARARGS | METH_KEYWORDS },
+    { "query", query_frametype, METH_O },
+    { "scan", (PyCFunction)id3_scan, METH_VARARGS | METH_KEYWORDS },
+    { "stats", (PyCFunction)stats_get, METH_NOARGS },
+    { "reset_stats", (PyCFunction)stats_reset, METH_NOARGS },
+    { "histograms", (PyCFunction)stats_histograms, METH_NOARGS },
+    { "set_slow_hook", set_slow_hook, METH_VARARGS },
+    { "audio_digests", (PyCFunction)audio_digests, METH_VARARGS | METH_KEYWORDS },
+    { "extract_pictures", (PyCFunction)extract_pictures, METH_VARARGS | METH_KEYWORDS },
+    { "stream_file", (PyCFunction)stream_file, METH_VARARGS },
     { NULL, NULL }
 };
 
@@ -1377,6 +5795,10 @@ extern "C" {
         PyObject *d;
         
         ID3Type.ob_type = &PyType_Type;
+	if ( PyType_Ready( &ID3Type ) < 0 )
+	    return;
+
+	pthread_key_create( &stat_key, stat_thread_exit );
         
         m = Py_InitModule( MODULE_NAME, module_methods );
         d = PyModule_GetDict( m );
@@ -1393,6 +5815,7 @@ extern "C" {
 	      magic_attribute_table[magic_attribute_table_size].name;
 	      ++magic_attribute_table_size )
 	    ;
+	magic_attribute_hash_init();
 
 	int i;
 	for ( i = ID3FN_NOFIELD; i <= ID3FN_LASTFIELDID; ++i )
@@ -1424,8 +5847,12 @@ extern "C" {
 
 	frame_id_key_obj = PyString_FromString( "frameid" );
 
+	// only the name -> ID mapping is built here; the rest of what
+	// query() returns is filled in on demand by query_frameid().
+	// each supported frame ID is also exported as an int constant
+	// (pyid3lib.TALB, etc.).
+	
 	ID3_FrameInfo finfo;
-	frameid_lookup = PyDict_New();
 
 	for ( i = ID3FID_NOFRAME+1; i < ID3FID_LASTFRAMEID; ++i )
 	{
@@ -1433,41 +5860,16 @@ extern "C" {
 	    s = finfo.LongName( (ID3_FrameID)i );
 	    if ( s && strlen(s) == 4 )
 	    {
-		PyObject* tuple = PyTuple_New( 3 );
-		PyTuple_SET_ITEM( tuple, 0, PyInt_FromLong( i ) );
-		PyTuple_SET_ITEM( tuple, 1, PyString_FromString( finfo.Description( (ID3_FrameID)i ) ) );
-		
-		ID3_Frame* frame = new ID3_Frame( (ID3_FrameID)i );
-		ID3_Frame::Iterator* fiter = frame->CreateIterator();
-		ID3_Field* field;
-
-		// overestimate the size.  "lyst" is a misnomer, it's
-		// actually a tuple.
-		PyObject* lyst;
-		lyst = PyTuple_New( frame->NumFields() );
-		int actual = 0;
-		
-		while( (field = fiter->GetNext()) )
-		{
-		    ID3_FieldID flid = field->GetID();
-		    if ( field_keys[flid] == NULL )
-			continue;
-
-		    Py_INCREF( field_keys[flid] );
-		    PyTuple_SET_ITEM( lyst, actual, field_keys[flid] );
-		    ++actual;
-		}
-		_PyTuple_Resize( &lyst, actual );
-
-		delete fiter;
-		delete frame;
-
-		PyTuple_SET_ITEM( tuple, 2, lyst );
+		frameid_code_table[frameid_code_table_size].code = FOURCC( s );
+		frameid_code_table[frameid_code_table_size].fid = (ID3_FrameID)i;
+		++frameid_code_table_size;
+		frameid_supported[i] = 1;
 
-		PyDict_SetItemString( frameid_lookup, s, tuple );
-		Py_DECREF( tuple );
+		PyModule_AddIntConstant( m, s, i );
 	    }
 	}
+	qsort( frameid_code_table, frameid_code_table_size,
+	       sizeof( frameid_code ), frameid_code_compare );
     }
 }
 
@@ -10,7 +10,7 @@ setup( name =    'pyid3lib',
 
        ext_modules = [Extension( 'pyid3lib',
                                  ['pyid3lib.cc'],
-                                 libraries=['stdc++','id3','z'] )]
+                                 libraries=['stdc++','id3','z','pthread'] )]
        )
 
        